@@ -6,7 +6,980 @@ using namespace InferenceEngine;
 // Create a macro to quickly mark a function for export
 #define DLLExport __declspec (dllexport)
 
-// Wrap code to prevent name-mangling issues
+// The number of heap allocations made by plugin code, counted by the operator new replacement below
+// Mat buffers OpenCV allocates are counted by the Mat allocator below, including its internal temporaries
+// Other allocations inside the OpenVINO and OpenCV libraries, such as the jobs cv::parallel_for_ creates,
+// go through those libraries' own operator new and are not included
+std::atomic<uint64_t> allocationCount{ 0 };
+// The number of bytes requested by those heap allocations
+std::atomic<uint64_t> allocatedBytes{ 0 };
+// The heap allocations made by the calling thread, so frame counts leave out other threads such as stream workers
+thread_local uint64_t threadAllocationCount = 0;
+// The bytes requested by those heap allocations
+thread_local uint64_t threadAllocatedBytes = 0;
+
+// Add an allocation to the process and thread counts
+void CountAllocation(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    threadAllocationCount++;
+    threadAllocatedBytes += size;
+}
+
+// Count every allocation made through operator new in this module
+void* operator new(size_t size) {
+    CountAllocation(size);
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+// Release memory from the operator new replacement
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+// Allocation statistics reported to the host
+struct AllocationStats {
+    // The heap allocations made by the last call to PerformInference or PerformInferenceROI
+    uint64_t frameCount;
+    // The bytes requested by those allocations
+    uint64_t frameBytes;
+    // The heap allocations made since the plugin was loaded
+    uint64_t totalCount;
+    // The bytes requested by those allocations
+    uint64_t totalBytes;
+};
+
+// The allocations made by the last call to PerformInference or PerformInferenceROI
+uint64_t lastFrameAllocations = 0;
+// The bytes requested by those allocations
+uint64_t lastFrameAllocatedBytes = 0;
+
+// Records the allocations the calling thread made between construction and destruction as the allocations for the frame
+// Allocations on cv::parallel_for_ worker threads are left out along with those of unrelated threads
+class FrameAllocationScope {
+public:
+    FrameAllocationScope() : startCount(threadAllocationCount), startBytes(threadAllocatedBytes) {}
+    ~FrameAllocationScope() {
+        lastFrameAllocations = threadAllocationCount - startCount;
+        lastFrameAllocatedBytes = threadAllocatedBytes - startBytes;
+    }
+private:
+    uint64_t startCount;
+    uint64_t startBytes;
+};
+
+// Counts the Mat buffers OpenCV allocates anywhere in the process, then defers to the standard allocator
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+        cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        cv::UMatData* u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        // Mats wrapping existing memory do not allocate
+        if (u && !data) CountAllocation(u->size);
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+        return cv::Mat::getStdAllocator()->allocate(u, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        cv::Mat::getStdAllocator()->deallocate(u);
+    }
+};
+
+// Installed as the default Mat allocator when the plugin is loaded
+CountingMatAllocator countingMatAllocator;
+const bool countingMatAllocatorInstalled = (cv::Mat::setDefaultAllocator(&countingMatAllocator), true);
+
+// Restore the process-wide state the plugin changed when the plugin is unloaded
+BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved) {
+    switch (ul_reason_for_call) {
+    case DLL_PROCESS_DETACH:
+        // OpenCV stays loaded in the host, so it must stop calling into the counting allocator
+        // Mats it already allocated keep working, the standard allocator owns their buffers
+        cv::Mat::setDefaultAllocator(cv::Mat::getStdAllocator());
+        break;
+    }
+    return TRUE;
+}
+
+// A 64-byte aligned block of memory that per-frame scratch buffers are carved from
+struct ScratchArena {
+    // The start of the block
+    uchar* base = nullptr;
+    // The size of the block in bytes
+    size_t capacity = 0;
+    // The number of bytes handed out since the last reset
+    size_t used = 0;
+
+    ~ScratchArena() {
+        _aligned_free(base);
+    }
+
+    // Discard the buffers handed out so far and make sure the block holds at least the given number of bytes
+    void Reset(size_t bytes) {
+        if (bytes > capacity) {
+            _aligned_free(base);
+            base = static_cast<uchar*>(_aligned_malloc(bytes, 64));
+            capacity = bytes;
+        }
+        used = 0;
+    }
+
+    // Hand out the next 64-byte aligned buffer, the arena must have been reset with room for it
+    uchar* Allocate(size_t bytes) {
+        uchar* buffer = base + used;
+        used += AlignedSize(bytes);
+        return buffer;
+    }
+
+    // Round a buffer size up to a multiple of 64 bytes
+    static size_t AlignedSize(size_t bytes) {
+        return (bytes + 63) & ~static_cast<size_t>(63);
+    }
+};
+
+// A single begin or end event recorded by the tracing facility
+struct TraceEvent {
+    // Static string naming the pipeline stage
+    const char* name;
+    // Microseconds since the trace epoch
+    int64_t timestamp;
+    // The frame the event belongs to, the PerformInference frame or the frame sequence number within a stream
+    uint64_t frameId;
+    // The stream the frame belongs to, -1 for frames passed to PerformInference
+    int streamId;
+    // 'B' for begin events and 'E' for end events
+    char phase;
+};
+
+// A ring of events written by a single thread and read by DumpTrace
+struct TraceBuffer {
+    // The number of events kept per thread before the oldest ones are overwritten
+    static const size_t capacity = 1 << 14;
+    TraceEvent events[capacity];
+    // The total number of events written, only ever updated by the owning thread
+    std::atomic<uint64_t> head{ 0 };
+    // The Windows id of the owning thread
+    DWORD threadId = 0;
+    // Set when the owning thread exits
+    std::atomic<bool> retired{ false };
+    // Set once DumpTrace has written the events of a retired buffer, so a new thread may take it over
+    bool reusable = false;
+};
+
+// Turns event recording on and off
+std::atomic<bool> tracingEnabled{ false };
+// The frame currently being processed by PerformInference
+std::atomic<uint64_t> traceFrameId{ 0 };
+// The reference point for event timestamps
+const auto traceEpoch = std::chrono::steady_clock::now();
+// The most buffers kept at once, threads that start tracing once every buffer is taken record no events
+const size_t maxTraceBuffers = 64;
+// The buffers of running threads and of exited threads, kept so DumpTrace can read them after their thread exits
+std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+// Guards traceBuffers and their reusable flags, only taken when a thread records its first event and when dumping
+std::mutex traceBuffersMutex;
+
+// Hands the current thread's buffer back when the thread exits
+struct TraceBufferOwner {
+    // The buffer owned by the thread, empty until the thread records its first event
+    TraceBuffer* buffer = nullptr;
+    // Indicates the thread found no buffer to take, so it records no events
+    bool exhausted = false;
+
+    ~TraceBufferOwner() {
+        if (buffer) buffer->retired.store(true, std::memory_order_release);
+    }
+};
+
+// The buffer owned by the current thread
+thread_local TraceBufferOwner threadTraceBuffer;
+// The stream frame the current thread is processing, overriding traceFrameId while set
+thread_local uint64_t threadTraceFrameId = 0;
+// The stream of that frame, -1 when the thread processes PerformInference frames
+thread_local int threadTraceStreamId = -1;
+
+// Get a buffer for the current thread, reusing a buffer of an exited thread whose events have been dumped
+TraceBuffer* AcquireTraceBuffer() {
+    std::lock_guard<std::mutex> lock(traceBuffersMutex);
+    TraceBuffer* buffer = nullptr;
+    for (auto& candidate : traceBuffers) {
+        if (candidate->reusable) {
+            buffer = candidate.get();
+            buffer->head.store(0, std::memory_order_relaxed);
+            buffer->retired.store(false, std::memory_order_relaxed);
+            buffer->reusable = false;
+            break;
+        }
+    }
+    if (!buffer) {
+        if (traceBuffers.size() >= maxTraceBuffers) return nullptr;
+        traceBuffers.push_back(std::make_unique<TraceBuffer>());
+        buffer = traceBuffers.back().get();
+    }
+    buffer->threadId = GetCurrentThreadId();
+    return buffer;
+}
+
+// Append an event to the ring owned by the current thread
+void RecordTraceEvent(const char* name, char phase) {
+    TraceBuffer* buffer = threadTraceBuffer.buffer;
+    if (!buffer) {
+        if (threadTraceBuffer.exhausted) return;
+        buffer = threadTraceBuffer.buffer = AcquireTraceBuffer();
+        threadTraceBuffer.exhausted = !buffer;
+        if (!buffer) return;
+    }
+
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[head % TraceBuffer::capacity];
+    event.name = name;
+    event.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+    event.frameId = threadTraceStreamId >= 0 ? threadTraceFrameId : traceFrameId.load(std::memory_order_relaxed);
+    event.streamId = threadTraceStreamId;
+    event.phase = phase;
+    // Publish the event to DumpTrace
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Stamps the events the current thread records with a stream frame until destruction
+class TraceStreamFrame {
+public:
+    TraceStreamFrame(int streamId, uint64_t frameId) {
+        threadTraceStreamId = streamId;
+        threadTraceFrameId = frameId;
+    }
+    ~TraceStreamFrame() {
+        threadTraceStreamId = -1;
+    }
+    TraceStreamFrame(const TraceStreamFrame&) = delete;
+    TraceStreamFrame& operator=(const TraceStreamFrame&) = delete;
+};
+
+// Records a begin event on construction and the matching end event on destruction
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name(tracingEnabled.load(std::memory_order_relaxed) ? name : nullptr) {
+        if (this->name) RecordTraceEvent(this->name, 'B');
+    }
+    ~TraceScope() {
+        if (name) RecordTraceEvent(name, 'E');
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+private:
+    // The stage name, or nullptr when tracing was disabled at construction
+    const char* name;
+};
+
+// The implementations available for packing the input tensor and unpacking the model output
+enum KernelVariant {
+    // Plain per-pixel loops used as the reference for the other variants
+    KERNEL_SCALAR = 0,
+    // SSE2 loops that handle 16 pixels (packing) or 4 pixels (unpacking) per iteration
+    KERNEL_SSE2 = 1,
+    // The SSE2 loops split across image rows with cv::parallel_for_
+    KERNEL_PARALLEL = 2,
+    // The number of available variants
+    KERNEL_COUNT = 3
+};
+
+// The channel orders supported for host image buffers
+enum ChannelOrder {
+    CHANNEL_ORDER_RGBA = 0,
+    CHANNEL_ORDER_BGRA = 1,
+    CHANNEL_ORDER_RGB = 2,
+    // The number of supported channel orders
+    CHANNEL_ORDER_COUNT = 3
+};
+
+// Where the color channels used by the model are stored within a host pixel
+struct PixelLayout {
+    // The number of bytes per pixel, either 3 or 4
+    int channels;
+    // The byte offsets of the red, green and blue channels within a pixel
+    int offsets[3];
+};
+
+// The pixel layouts for each channel order
+const PixelLayout pixelLayouts[CHANNEL_ORDER_COUNT] = {
+    { 4, { 0, 1, 2 } },
+    { 4, { 2, 1, 0 } },
+    { 3, { 0, 1, 2 } }
+};
+
+// Describes the memory layout of a host image buffer
+struct BufferDesc {
+    // The number of bytes between the starts of consecutive rows, smaller values mean tightly packed rows
+    int rowPitch;
+    // Nonzero when the first row in memory is the bottom row of the image
+    int flipY;
+    // The order of the color channels in each pixel, one of ChannelOrder
+    int channelOrder;
+};
+
+// A host image buffer as seen by the kernels
+struct ImageView {
+    // The first pixel of the top row of the image
+    uchar* data;
+    // The number of bytes from one row to the row below it, negative for bottom-up buffers
+    ptrdiff_t pitch;
+    // The channel layout of each pixel
+    PixelLayout layout;
+};
+
+// Get the view of a host image buffer, treating a missing descriptor as a tightly packed top-down RGBA buffer
+ImageView MakeImageView(uchar* data, const BufferDesc* desc, size_t width, size_t height) {
+    int order = desc && desc->channelOrder >= 0 && desc->channelOrder < CHANNEL_ORDER_COUNT ? desc->channelOrder : CHANNEL_ORDER_RGBA;
+    ImageView view = { data, 0, pixelLayouts[order] };
+    // Rows may be padded but never overlap
+    ptrdiff_t rowBytes = static_cast<ptrdiff_t>(width * view.layout.channels);
+    view.pitch = desc ? std::max(static_cast<ptrdiff_t>(desc->rowPitch), rowBytes) : rowBytes;
+    if (desc && desc->flipY) {
+        // Start at the top row, which is the last row in memory
+        view.data += (height - 1) * view.pitch;
+        view.pitch = -view.pitch;
+    }
+    return view;
+}
+
+// Copy one row of host pixels into the planar RGB input tensor
+void PackRowScalar(const uchar* src, uchar* dst, size_t width, size_t planeSize, const PixelLayout& layout) {
+    // Iterate over each pixel in the row
+    for (size_t x = 0; x < width; x++) {
+        // Iterate over each color channel, skipping the alpha channel
+        for (size_t ch = 0; ch < 3; ch++) {
+            dst[ch * planeSize + x] = src[x * layout.channels + layout.offsets[ch]];
+        }
+    }
+}
+
+// Copy one row of host pixels into the planar RGB input tensor using SSE2
+// Only 4-byte pixels are vectorized, 3-byte pixels use the scalar loop
+void PackRowSSE2(const uchar* src, uchar* dst, size_t width, size_t planeSize, const PixelLayout& layout) {
+    if (layout.channels != 4) {
+        PackRowScalar(src, dst, width, planeSize, layout);
+        return;
+    }
+
+    // Selects the lowest byte of each 32-bit pixel
+    const __m128i mask = _mm_set1_epi32(0xFF);
+
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        // Load 16 pixels
+        __m128i px[4];
+        for (int i = 0; i < 4; i++) {
+            px[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (x + i * 4) * 4));
+        }
+
+        for (int ch = 0; ch < 3; ch++) {
+            // Move the current channel to the lowest byte of each pixel
+            const __m128i shift = _mm_cvtsi32_si128(layout.offsets[ch] * 8);
+            __m128i c[4];
+            for (int i = 0; i < 4; i++) {
+                c[i] = _mm_and_si128(_mm_srl_epi32(px[i], shift), mask);
+            }
+            // Narrow the 32-bit values down to 16 consecutive bytes
+            __m128i lo = _mm_packs_epi32(c[0], c[1]);
+            __m128i hi = _mm_packs_epi32(c[2], c[3]);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ch * planeSize + x), _mm_packus_epi16(lo, hi));
+        }
+    }
+    // Handle the remaining pixels
+    PackRowScalar(src + x * 4, dst + x, width - x, planeSize, layout);
+}
+
+// Copy one row of the planar model output into host pixels, clamping values to [0, 255]
+void UnpackRowScalar(const float* src, uchar* dst, size_t width, size_t planeSize, const PixelLayout& layout) {
+    // Iterate over each pixel in the row
+    for (size_t x = 0; x < width; x++) {
+        uchar* pixel = dst + x * layout.channels;
+        // Iterate over each color channel
+        for (size_t ch = 0; ch < 3; ch++) {
+            float value = src[ch * planeSize + x];
+            // Clamp color values to the range [0, 255] (matches _mm_max_ps/_mm_min_ps, NaN becomes 0)
+            value = value > 0.f ? value : 0.f;
+            value = value < 255.f ? value : 255.f;
+            pixel[layout.offsets[ch]] = static_cast<uchar>(value);
+        }
+        // Set the alpha channel to fully opaque
+        if (layout.channels == 4) pixel[3] = 255;
+    }
+}
+
+// Copy one row of the planar model output into host pixels using SSE2
+// Only 4-byte pixels are vectorized, 3-byte pixels use the scalar loop
+void UnpackRowSSE2(const float* src, uchar* dst, size_t width, size_t planeSize, const PixelLayout& layout) {
+    if (layout.channels != 4) {
+        UnpackRowScalar(src, dst, width, planeSize, layout);
+        return;
+    }
+
+    // A fully opaque alpha channel
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    const __m128 minValue = _mm_setzero_ps();
+    const __m128 maxValue = _mm_set1_ps(255.f);
+
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = alpha;
+        for (int ch = 0; ch < 3; ch++) {
+            // Load 4 values for the current channel and clamp them to [0, 255]
+            __m128 value = _mm_loadu_ps(src + ch * planeSize + x);
+            value = _mm_min_ps(_mm_max_ps(value, minValue), maxValue);
+            // Truncate to integers and move them into the byte for the current channel
+            px = _mm_or_si128(px, _mm_sll_epi32(_mm_cvttps_epi32(value), _mm_cvtsi32_si128(layout.offsets[ch] * 8)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), px);
+    }
+    // Handle the remaining pixels
+    UnpackRowScalar(src + x, dst + x * 4, width - x, planeSize, layout);
+}
+
+// Packs a range of image rows into the planar RGB input tensor
+// Implemented as a ParallelLoopBody rather than a lambda so cv::parallel_for_ does not allocate a std::function
+class PackRowsBody : public cv::ParallelLoopBody {
+public:
+    PackRowsBody(int variant, const ImageView& src, uchar* dst, size_t width, size_t planeWidth, size_t planeSize)
+        : variant(variant), src(src), dst(dst), width(width), planeWidth(planeWidth), planeSize(planeSize) {}
+
+    void operator()(const cv::Range& rows) const override {
+        TraceScope trace("PackRows");
+        for (int y = rows.start; y < rows.end; y++) {
+            const uchar* srcRow = src.data + y * src.pitch;
+            uchar* row = dst + y * planeWidth;
+            if (variant == KERNEL_SCALAR) PackRowScalar(srcRow, row, width, planeSize, src.layout);
+            else PackRowSSE2(srcRow, row, width, planeSize, src.layout);
+            // Replicate the last pixel across the padding on the right
+            for (size_t ch = 0; ch < 3; ch++) {
+                uchar* plane = row + ch * planeSize;
+                std::memset(plane + width, plane[width - 1], planeWidth - width);
+            }
+        }
+    }
+
+private:
+    int variant;
+    ImageView src;
+    uchar* dst;
+    size_t width;
+    size_t planeWidth;
+    size_t planeSize;
+};
+
+// Unpacks a range of rows from the planar model output into host pixels
+class UnpackRowsBody : public cv::ParallelLoopBody {
+public:
+    UnpackRowsBody(int variant, const float* src, const ImageView& dst, size_t width, size_t planeWidth, size_t planeSize)
+        : variant(variant), src(src), dst(dst), width(width), planeWidth(planeWidth), planeSize(planeSize) {}
+
+    void operator()(const cv::Range& rows) const override {
+        TraceScope trace("UnpackRows");
+        for (int y = rows.start; y < rows.end; y++) {
+            uchar* dstRow = dst.data + y * dst.pitch;
+            if (variant == KERNEL_SCALAR) UnpackRowScalar(src + y * planeWidth, dstRow, width, planeSize, dst.layout);
+            else UnpackRowSSE2(src + y * planeWidth, dstRow, width, planeSize, dst.layout);
+        }
+    }
+
+private:
+    int variant;
+    const float* src;
+    ImageView dst;
+    size_t width;
+    size_t planeWidth;
+    size_t planeSize;
+};
+
+// Pack a host image into the planar RGB input tensor
+// Planes larger than the image are filled by replicating the last column and row of the image
+void PackInput(int variant, const ImageView& src, uchar* dst, size_t width, size_t height,
+    size_t planeWidth, size_t planeHeight) {
+    size_t planeSize = planeWidth * planeHeight;
+    PackRowsBody packRows(variant, src, dst, width, planeWidth, planeSize);
+    if (variant == KERNEL_PARALLEL) cv::parallel_for_(cv::Range(0, static_cast<int>(height)), packRows);
+    else packRows(cv::Range(0, static_cast<int>(height)));
+
+    // Replicate the last row across the padding at the bottom
+    for (size_t ch = 0; ch < 3; ch++) {
+        uchar* plane = dst + ch * planeSize;
+        for (size_t y = height; y < planeHeight; y++) {
+            std::memcpy(plane + y * planeWidth, plane + (height - 1) * planeWidth, planeWidth);
+        }
+    }
+}
+
+// Unpack the planar model output into a host image
+// Only the top-left width x height pixels of larger planes are unpacked
+void UnpackOutput(int variant, const float* src, const ImageView& dst, size_t width, size_t height,
+    size_t planeWidth, size_t planeHeight) {
+    size_t planeSize = planeWidth * planeHeight;
+    UnpackRowsBody unpackRows(variant, src, dst, width, planeWidth, planeSize);
+    if (variant == KERNEL_PARALLEL) cv::parallel_for_(cv::Range(0, static_cast<int>(height)), unpackRows);
+    else unpackRows(cv::Range(0, static_cast<int>(height)));
+}
+
+// Copy a host image into another host image, converting the channel order and filling in an opaque alpha channel if needed
+void CopyImage(const ImageView& src, const ImageView& dst, size_t width, size_t height) {
+    bool sameLayout = src.layout.channels == dst.layout.channels && std::equal(src.layout.offsets, src.layout.offsets + 3, dst.layout.offsets);
+    // Nothing to do when both views describe the same pixels
+    if (src.data == dst.data && src.pitch == dst.pitch && sameLayout) return;
+
+    // Views of the same rows in opposite order, such as an in-place frame with a different flipY for input and output,
+    // write each row over the source row at the mirrored position, so mirrored rows are converted as pairs
+    // after reading both of them
+    bool mirrored = height > 0 && src.layout.channels == dst.layout.channels && src.pitch == -dst.pitch
+        && dst.data == src.data + static_cast<ptrdiff_t>(height - 1) * src.pitch;
+
+    for (size_t y = 0; y < (mirrored ? (height + 1) / 2 : height); y++) {
+        const uchar* srcRow = src.data + static_cast<ptrdiff_t>(y) * src.pitch;
+        uchar* dstRow = dst.data + static_cast<ptrdiff_t>(y) * dst.pitch;
+        // The source row dstRow overwrites, and the destination row that overwrites srcRow
+        size_t pair = height - 1 - y;
+        const uchar* srcPair = src.data + static_cast<ptrdiff_t>(pair) * src.pitch;
+        uchar* dstPair = dst.data + static_cast<ptrdiff_t>(pair) * dst.pitch;
+        bool swapRows = mirrored && pair != y;
+
+        if (sameLayout) {
+            // dstRow is srcPair and dstPair is srcRow, so the copy is a swap
+            if (swapRows) std::swap_ranges(dstRow, dstRow + width * dst.layout.channels, dstPair);
+            else std::memmove(dstRow, srcRow, width * dst.layout.channels);
+            continue;
+        }
+        for (size_t x = 0; x < width; x++) {
+            // Read the whole pixel first so views of the same buffer with different channel orders work
+            const uchar* srcPixel = srcRow + x * src.layout.channels;
+            uchar rgba[4] = { srcPixel[src.layout.offsets[0]], srcPixel[src.layout.offsets[1]], srcPixel[src.layout.offsets[2]],
+                static_cast<uchar>(src.layout.channels == 4 ? srcPixel[3] : 255) };
+            if (swapRows) {
+                // Read the mirrored pixel before either destination pixel overwrites it
+                const uchar* pairPixel = srcPair + x * src.layout.channels;
+                uchar pairRgba[4] = { pairPixel[src.layout.offsets[0]], pairPixel[src.layout.offsets[1]], pairPixel[src.layout.offsets[2]],
+                    static_cast<uchar>(src.layout.channels == 4 ? pairPixel[3] : 255) };
+                uchar* dstPairPixel = dstPair + x * dst.layout.channels;
+                for (size_t ch = 0; ch < 3; ch++) dstPairPixel[dst.layout.offsets[ch]] = pairRgba[ch];
+                if (dst.layout.channels == 4) dstPairPixel[3] = pairRgba[3];
+            }
+            uchar* dstPixel = dstRow + x * dst.layout.channels;
+            for (size_t ch = 0; ch < 3; ch++) dstPixel[dst.layout.offsets[ch]] = rgba[ch];
+            if (dst.layout.channels == 4) dstPixel[3] = rgba[3];
+        }
+    }
+}
+
+// Wrap a host image in a Mat that follows its memory row order, so bottom-up buffers appear upside down
+cv::Mat MemoryMat(const ImageView& view, int width, int height) {
+    uchar* first = view.pitch < 0 ? view.data + (height - 1) * view.pitch : view.data;
+    size_t step = static_cast<size_t>(view.pitch < 0 ? -view.pitch : view.pitch);
+    return cv::Mat(height, width, CV_8UC(view.layout.channels), first, step);
+}
+
+// Compare every kernel variant against the scalar reference for one image size, padded plane size and buffer layout
+// Returns true when all variants produce identical output
+bool CheckKernels(size_t width, size_t height, size_t planeWidth, size_t planeHeight, int channelOrder, bool flipY,
+    std::mt19937& rng) {
+    size_t planeSize = planeWidth * planeHeight;
+    // Leave some slack at the end of each row to exercise the row pitch
+    BufferDesc desc = { static_cast<int>(width * pixelLayouts[channelOrder].channels + 5), flipY ? 1 : 0, channelOrder };
+    size_t bufferSize = desc.rowPitch * height;
+
+    // Random input pixels and random model output, including values outside the [0, 255] clamp range
+    std::vector<uchar> pixels(bufferSize);
+    std::vector<float> planar(planeSize * 3);
+    std::uniform_int_distribution<int> byteDist(0, 255);
+    std::uniform_real_distribution<float> floatDist(-64.f, 320.f);
+    for (auto& value : pixels) value = static_cast<uchar>(byteDist(rng));
+    for (auto& value : planar) value = floatDist(rng);
+    ImageView input = MakeImageView(pixels.data(), &desc, width, height);
+
+    // Reference output, starting from the same bytes so the row slack must be left untouched
+    std::vector<uchar> packedRef(planeSize * 3);
+    std::vector<uchar> unpackedRef(pixels);
+    ImageView outputRef = MakeImageView(unpackedRef.data(), &desc, width, height);
+    PackInput(KERNEL_SCALAR, input, packedRef.data(), width, height, planeWidth, planeHeight);
+    UnpackOutput(KERNEL_SCALAR, planar.data(), outputRef, width, height, planeWidth, planeHeight);
+
+    // The bottom-right padding must repeat the bottom-right pixel of the image
+    const uchar* lastPixel = input.data + (height - 1) * input.pitch + (width - 1) * input.layout.channels;
+    for (size_t ch = 0; ch < 3; ch++) {
+        if (packedRef[ch * planeSize + planeSize - 1] != lastPixel[input.layout.offsets[ch]]) return false;
+    }
+
+    std::vector<uchar> packed(planeSize * 3);
+    std::vector<uchar> unpacked(bufferSize);
+    for (int variant = KERNEL_SCALAR + 1; variant < KERNEL_COUNT; variant++) {
+        unpacked = pixels;
+        ImageView output = MakeImageView(unpacked.data(), &desc, width, height);
+        PackInput(variant, input, packed.data(), width, height, planeWidth, planeHeight);
+        UnpackOutput(variant, planar.data(), output, width, height, planeWidth, planeHeight);
+        if (packed != packedRef || unpacked != unpackedRef) return false;
+    }
+    return true;
+}
+
+// A read-only memory mapping of an IR weights file, shared by every network read from the file
+struct MappedWeights {
+    // The path of the weights file
+    std::string path;
+    // The size of the weights file in bytes
+    size_t size = 0;
+    // Wraps the mapped view so it can be passed to Core::ReadNetwork without copying
+    // The view stays mapped for as long as any copy of the blob is alive, including the ones held by networks
+    Blob::CPtr blob;
+};
+
+// The mapped view of a weights file, unmapped when the last copy of the blob aliasing it is released
+struct WeightsView {
+    // The handle for the weights file
+    HANDLE file = INVALID_HANDLE_VALUE;
+    // The handle for the file mapping object
+    HANDLE mapping = nullptr;
+    // The start of the mapped view
+    const void* data = nullptr;
+    // Wraps the mapped view without owning it
+    Blob::Ptr blob;
+
+    ~WeightsView() {
+        blob.reset();
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+};
+
+// Memory usage reported to the host
+struct MemoryUsage {
+    // The physical memory currently used by the process, in bytes
+    uint64_t workingSetBytes;
+    // The memory committed privately by the process, in bytes
+    uint64_t privateBytes;
+    // The size of the weights files currently mapped, in bytes
+    uint64_t mappedWeightsBytes;
+};
+
+// A network compiled for one input resolution along with its inference request and tensors
+struct CompiledShape {
+    // Provides an interface for an executable network on the compute device
+    ExecutableNetwork executable_network;
+    // Provides an interface for an asynchronous inference request
+    InferRequest infer_request;
+    // A poiner to the input tensor for the model
+    MemoryBlob::Ptr minput;
+    // A poiner to the output tensor for the model
+    MemoryBlob::CPtr moutput;
+    // The width of the input image
+    size_t width = 0;
+    // The height of the input image
+    size_t height = 0;
+    // The width of the output planes, which may differ from the input when the model's stride does not divide it
+    size_t outputWidth = 0;
+    // The height of the output planes
+    size_t outputHeight = 0;
+};
+
+// An input size in the compiled network cache of a session
+struct CompiledShapeEntry {
+    // The compiled network, not ready yet while the first caller for the size is compiling it
+    std::shared_future<std::shared_ptr<CompiledShape>> compiled;
+    // The GetCompiledShape call that last returned the network, used to evict the least recently used size
+    uint64_t lastUsed = 0;
+};
+
+// A model that is ready to perform inference on a compute device
+struct ModelSession {
+    // The mapped weights the network was read from, empty if the weights were loaded into the heap
+    std::shared_ptr<MappedWeights> weights;
+    // The network the executable network was compiled from
+    CNNNetwork network;
+    // The name of the input layer of the network
+    std::string inputName;
+    // The name of the output layer of the network
+    std::string outputName;
+    // The index of the compute device in availableDevices
+    int deviceNum = 0;
+    // The name of the compute device, copied so background threads never read availableDevices
+    std::string deviceName;
+    // Identifies the model the network was read from
+    uint64_t modelGeneration = 0;
+    // The network compiled for the current input resolution
+    std::shared_ptr<CompiledShape> compiled;
+    // The width of the images passed to PerformInference, smaller than the compiled width when bucketing pads the input
+    size_t imageWidth = 0;
+    // The height of the images passed to PerformInference, smaller than the compiled height when bucketing pads the input
+    size_t imageHeight = 0;
+    // Every input size compiled so far, keyed by width and height
+    std::map<std::pair<size_t, size_t>, CompiledShapeEntry> compiledShapes;
+    // Counts GetCompiledShape calls to order compiledShapes by last use
+    uint64_t compiledShapesTick = 0;
+    // Guards compiledShapes
+    std::mutex compiledShapesMutex;
+    // Guards reshaping network, shared with every session and global that holds the same network
+    // CNNNetwork copies are shallow, so they all reshape the same underlying object
+    std::shared_ptr<std::mutex> networkMutex;
+};
+
+// Settings read while processing frames, published as an immutable snapshot
+// Stream workers and background compiles read the snapshot instead of the globals the host thread writes
+struct PipelineConfig {
+    // The input sizes requested dimensions are rounded up to, empty when bucketing is disabled
+    std::vector<std::pair<int, int>> shapeBuckets;
+    // The implementation used to pack the input tensor and unpack the model output
+    int kernelVariant = KERNEL_PARALLEL;
+    // The number of threads networks are compiled with for CPU devices, zero to let OpenVINO decide
+    int cpuThreadLimit = 0;
+    // The number of stream workers CPU networks are compiled to run in parallel for
+    int streamWorkerCount = 0;
+};
+
+// A rectangle within the caller's image, in pixels
+struct ImageRect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// State for pacing asynchronous inference requests against the host frame budget
+struct FrameScheduler {
+    // The session that owns the inference request in flight, empty when no request is in flight
+    std::shared_ptr<ModelSession> inflight;
+    // Indicates the request in flight has finished and its output has not been unpacked yet
+    bool resultReady = false;
+    // The most recent stylized frame in RGBA format, carved from the scratch arena
+    uchar* lastOutput = nullptr;
+    // Indicates lastOutput holds a finished frame
+    bool hasOutput = false;
+    // When the request in flight was started
+    std::chrono::steady_clock::time_point submitTime;
+    // The earliest time the next request may be started to stay within the target rate
+    std::chrono::steady_clock::time_point nextSubmitTime;
+    // When the last request finished
+    std::chrono::steady_clock::time_point lastCompletionTime;
+    // Moving average of the time spent packing the input tensor, in milliseconds
+    float packMs = 0.f;
+    // Moving average of the time spent unpacking the model output, in milliseconds
+    float unpackMs = 0.f;
+    // Moving average of the host thread time spent in PerformInference, in milliseconds
+    float hostMs = 0.f;
+    // Moving average of the time from starting a request to seeing it finish, in milliseconds
+    float latencyMs = 0.f;
+    // Moving average of the time between finished requests, in milliseconds
+    float completionIntervalMs = 0.f;
+    // The number of frames where starting a request was postponed to stay within the budget
+    int deferredFrames = 0;
+    // The number of frames that may not start a request because the last pack alone exceeded the budget
+    int skipFrames = 0;
+};
+
+// Scheduler statistics reported to the host
+struct SchedulerStats {
+    // The host thread time per frame the plugin may use, in milliseconds
+    float budgetMs;
+    // The average host thread time per frame the plugin used, in milliseconds
+    float hostMs;
+    // The requested number of inference requests per second
+    float targetRate;
+    // The measured number of finished inference requests per second
+    float achievedRate;
+    // The average time from starting a request to seeing it finish, in milliseconds
+    float latencyMs;
+    // The number of frames where starting a request was postponed to stay within the budget
+    int deferredFrames;
+};
+
+// State for reusing stylized keyframes by warping them along the optical flow of later frames
+// The Mats are views of the scratch arena, so OpenCV writes into them without reallocating
+struct TemporalState {
+    // Estimates dense optical flow between downscaled frames
+    cv::Ptr<cv::DISOpticalFlow> flow;
+    // The stylized output of the last keyframe, with room for 4 bytes per pixel
+    uchar* keyOutput = nullptr;
+    // The OpenCV type of the pixels in keyOutput
+    int keyType = 0;
+    // The downscaled grayscale input of the last keyframe
+    cv::Mat keyGray;
+    // The full size grayscale input of the current frame
+    cv::Mat fullGray;
+    // The downscaled grayscale input of the current frame
+    cv::Mat gray;
+    // The flow from the current frame to the keyframe at the downscaled size
+    cv::Mat flowField;
+    // The flow upscaled to the full frame size
+    cv::Mat flowFull;
+    // The pixel coordinates of the full frame
+    cv::Mat grid;
+    // The keyframe coordinates to sample for each pixel of the current frame
+    cv::Mat map;
+    // Indicates keyOutput holds a stylized keyframe
+    bool hasKeyframe = false;
+    // The number of frames warped since the last keyframe
+    int framesSinceKeyframe = 0;
+    // The number of frames that ran inference
+    int keyframes = 0;
+    // The number of frames produced by warping a keyframe
+    int warpedFrames = 0;
+    // The root mean square motion of the last frame relative to its keyframe, in full size pixels
+    float lastMotion = 0.f;
+};
+
+// A frame submitted to a stream, held in one of the stream's preallocated frame buffers
+struct StreamFrame {
+    // The frame's pixels, top-down and tightly packed, with room for 4 bytes per pixel
+    std::vector<uchar> pixels;
+    // The channel order of the pixels
+    PixelLayout layout;
+    // Identifies the frame within its stream, starting from one
+    int sequence = 0;
+    // When the frame was submitted
+    std::chrono::steady_clock::time_point submitTime;
+    // When the result stops being useful, only used for streams with a deadline
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// A feed of frames that shares the stream workers with other feeds
+struct InferenceStream {
+    // The id returned by RegisterStream
+    int id = 0;
+    // The width of the stream's frames
+    int width = 0;
+    // The height of the stream's frames
+    int height = 0;
+    // The stream's share of inference time relative to other streams
+    float weight = 1.f;
+    // The time after submission a frame's result is still useful, in milliseconds, zero for no deadline
+    float deadlineMs = 0.f;
+    // Frame buffers, allocated when the stream is registered
+    std::vector<StreamFrame> frames;
+    // Indices of frames that are neither queued nor being processed
+    std::vector<int> freeFrames;
+    // Ring buffer of the indices of queued frames, oldest first
+    std::vector<int> queue;
+    // The position of the oldest queued frame in queue
+    size_t queueHead = 0;
+    // The number of queued frames
+    size_t queueCount = 0;
+    // The sequence number given to the next submitted frame
+    int nextSequence = 1;
+    // The virtual time the stream's last dispatched frame finishes at under weighted fair queueing
+    double virtualFinish = 0.0;
+    // Indicates headStart and headFinish hold the fair queueing tags of the oldest queued frame
+    bool headTagged = false;
+    // The virtual time the oldest queued frame starts at
+    double headStart = 0.0;
+    // The virtual time the oldest queued frame finishes at
+    double headFinish = 0.0;
+    // Moving average of the time a worker spends on one of the stream's frames, in milliseconds
+    float serviceMs = 0.f;
+    // The stylized output of the newest finished frame in RGBA format
+    std::vector<uchar> result;
+    // The sequence number of the frame in result, zero before the first frame finishes
+    int resultSequence = 0;
+    // Guards result and resultSequence
+    std::mutex resultMutex;
+    // The number of frames submitted
+    int submitted = 0;
+    // The number of frames processed
+    int completed = 0;
+    // The number of frames dropped because the queue was full or their deadline passed
+    int dropped = 0;
+    // The number of processed frames that finished after their deadline
+    int lateFrames = 0;
+    // Moving average of the time from submitting a frame to its result being ready, in milliseconds
+    float latencyMs = 0.f;
+    // The longest time from submitting a frame to its result being ready, in milliseconds
+    float maxLatencyMs = 0.f;
+
+    // Get the oldest queued frame
+    StreamFrame& Front() {
+        return frames[queue[queueHead]];
+    }
+
+    // Add a frame to the back of the queue
+    void Push(int frameIndex) {
+        queue[(queueHead + queueCount) % queue.size()] = frameIndex;
+        queueCount++;
+    }
+
+    // Remove the oldest queued frame from the queue
+    int Pop() {
+        int frameIndex = queue[queueHead];
+        queueHead = (queueHead + 1) % queue.size();
+        queueCount--;
+        return frameIndex;
+    }
+};
+
+// Per-stream statistics reported to the host
+struct StreamStats {
+    // The number of frames submitted
+    int submitted;
+    // The number of frames processed
+    int completed;
+    // The number of frames dropped because the queue was full or their deadline passed
+    int dropped;
+    // The number of processed frames that finished after their deadline
+    int lateFrames;
+    // The number of frames waiting in the queue
+    int queued;
+    // The average time from submitting a frame to its result being ready, in milliseconds
+    float latencyMs;
+    // The longest time from submitting a frame to its result being ready, in milliseconds
+    float maxLatencyMs;
+    // The average time a worker spends on one frame, in milliseconds
+    float serviceMs;
+};
+
+// An inference request owned by a stream worker for one compiled network
+struct PooledRequest {
+    // The compiled network the request was created from
+    std::shared_ptr<CompiledShape> compiled;
+    // Provides an interface for an inference request
+    InferRequest request;
+    // A poiner to the input tensor of the request
+    MemoryBlob::Ptr minput;
+    // A poiner to the output tensor of the request
+    MemoryBlob::CPtr moutput;
+};
+
+// Streams and the worker threads that share the inference requests between them
+struct StreamDispatcher {
+    // Streams registered with RegisterStream, indexed by stream id, empty for unregistered streams
+    std::vector<std::shared_ptr<InferenceStream>> streams;
+    // Guards streams, their queues and statistics, running and virtualTime
+    std::mutex mutex;
+    // Wakes workers when a frame is queued or the dispatcher stops
+    std::condition_variable frameQueued;
+    // Threads that take frames from the stream queues, each with its own inference requests
+    std::vector<std::thread> workers;
+    // Tells the workers to keep running
+    bool running = false;
+    // The virtual time of weighted fair queueing, the start of the last frame dispatched by fair share
+    double virtualTime = 0.0;
+
+    // Each worker holds a reference to the plugin module, so the plugin is only unloaded with workers left
+    // when the process exits, after Windows has terminated them. Joining from a DLL detach would deadlock on the loader lock
+    ~StreamDispatcher() {
+        for (auto& worker : workers) {
+            if (worker.joinable()) worker.detach();
+        }
+    }
+};
+
+// Get the number of milliseconds between two points in time
+float ElapsedMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+// Update an exponential moving average, starting from the first sample
+void UpdateAverage(float& average, float sample) {
+    average = average == 0.f ? sample : average * 0.9f + sample * 0.1f;
+}
+
+// Wrap the plugin state to prevent name-mangling issues
 extern "C" {
 
     // List of available compute devices
@@ -18,30 +991,780 @@ extern "C" {
     // The name of the output layer of Neural Network "140"
     std::string firstOutputName;
 
-    // Stores the pixel data for model input image and output image
-    cv::Mat texture;
-
     // Inference engine instance
     Core ie;
     // Contains all the information about the Neural Network topology and related constant values for the model
     CNNNetwork network;
-    // Provides an interface for an executable network on the compute device
-    ExecutableNetwork executable_network;
-    // Provides an interface for an asynchronous inference request
-    InferRequest infer_request;
+    // The mapped weights network was read from
+    std::shared_ptr<MappedWeights> networkWeights;
+    // Guards reshaping network, shared with the sessions created from it
+    std::shared_ptr<std::mutex> networkMutex = std::make_shared<std::mutex>();
+    // Weights files that are currently mapped, keyed by path
+    std::map<std::string, std::weak_ptr<MappedWeights>> mappedWeights;
+    // Guards mappedWeights
+    std::mutex mappedWeightsMutex;
 
-    // A poiner to the input tensor for the model
-    MemoryBlob::Ptr minput;
-    // A poiner to the output tensor for the model
-    MemoryBlob::CPtr moutput;
+    // The session used by PerformInference, replaced atomically by UploadModelToDevice and SwapModel
+    std::shared_ptr<ModelSession> activeSession;
+    // A session being prepared in the background by PrepareModel
+    std::future<std::shared_ptr<ModelSession>> pendingSession;
+    // Set to stop the job behind pendingSession once a newer PrepareModel call supersedes it
+    std::shared_ptr<std::atomic<bool>> pendingCancelled;
+    // Sessions replaced by a newer session that frames or stream workers may still be using
+    std::vector<std::shared_ptr<ModelSession>> retiredSessions;
+    // Background releases of retired sessions nothing uses anymore, so the host never waits on teardown
+    std::vector<std::future<void>> releasedSessions;
+    // Incremented whenever a different model is loaded so compiled networks are only reused for the same model
+    uint64_t modelGeneration = 0;
+
+    // The input sizes requested dimensions are rounded up to, empty when bucketing is disabled
+    std::vector<std::pair<int, int>> shapeBuckets;
+    // PerformInferenceROI rounds region sizes up to a multiple of this before picking a bucket
+    // A multiple of the model's total stride keeps the output planes the size of the input
+    // and limits how many sizes regions of slightly different sizes compile
+    const int regionGranularity = 32;
+    // The number of input sizes each session keeps compiled
+    const size_t maxCompiledShapes = 8;
+    // The input width requested with SetInputDims
+    int requestedWidth = 0;
+    // The input height requested with SetInputDims
+    int requestedHeight = 0;
+
+    // The implementation used to pack the input tensor and unpack the model output
+    int kernelVariant = KERNEL_PARALLEL;
+
+    // The host thread time per frame PerformInference may use, zero when the scheduler is disabled
+    float frameBudgetMs = 0.f;
+    // The maximum number of inference requests started per second by the scheduler
+    float targetInferenceRate = 0.f;
+    // The number of threads networks are compiled with for CPU devices, zero to let OpenVINO decide
+    int cpuThreadLimit = 0;
+    // Paces asynchronous inference requests when the scheduler is enabled
+    FrameScheduler scheduler;
+
+    // The maximum number of frames between inference runs in temporal mode, zero when temporal mode is disabled
+    int keyframeInterval = 0;
+    // The motion relative to the keyframe, in pixels, that forces a new inference run, zero or less to only use the interval
+    float motionThreshold = 0.f;
+    // The scale frames are downsized by before estimating optical flow
+    float flowScale = 0.25f;
+    // Keyframes and scratch buffers for temporal mode
+    TemporalState temporal;
 
-    // The number of color channels 
-    size_t num_channels;
-    // The number of pixels in the input image
-    size_t nPixels;
+    // Shares the stream workers between the registered streams
+    StreamDispatcher dispatcher;
+    // The number of stream workers CPU networks are compiled to run in parallel for, zero until the dispatcher is started
+    int streamWorkerCount = 0;
 
-    // A vector for processing the raw model output
-    std::vector<float> data_img;
+    // The current settings for threads other than the host thread, replaced by PublishPipelineConfig
+    std::shared_ptr<const PipelineConfig> pipelineConfig = std::make_shared<PipelineConfig>();
+
+    // Holds the scratch buffers for scheduler and temporal mode
+    ScratchArena scratch;
+    // The frame width the scratch buffers were carved for
+    size_t scratchWidth = 0;
+    // The frame height the scratch buffers were carved for
+    size_t scratchHeight = 0;
+}
+
+// Configure the cache directory for GPU compute devices
+void SetDeviceCache() {
+    std::regex e("(GPU)(.*)");
+    // Iterate through the available compute devices
+    for (auto&& device : availableDevices) {
+        // Only configure the cache directory for GPUs
+        if (std::regex_match(device, e)) {
+            ie.SetConfig({ {CONFIG_KEY(CACHE_DIR), "cache"} }, device);
+        }
+    }
+}
+
+// Map a weights file into memory, reusing the existing mapping if the file is already mapped
+// Returns an empty pointer when the file cannot be mapped
+std::shared_ptr<MappedWeights> MapWeights(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mappedWeightsMutex);
+    // Forget mappings nothing uses anymore
+    for (auto it = mappedWeights.begin(); it != mappedWeights.end();) {
+        it = it->second.expired() ? mappedWeights.erase(it) : std::next(it);
+    }
+    auto cached = mappedWeights.find(path);
+    if (cached != mappedWeights.end()) return cached->second.lock();
+
+    auto view = std::make_shared<WeightsView>();
+    view->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (view->file == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(view->file, &fileSize) || fileSize.QuadPart == 0) return nullptr;
+    view->mapping = CreateFileMappingA(view->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!view->mapping) return nullptr;
+    view->data = MapViewOfFile(view->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view->data) return nullptr;
+
+    auto mapped = std::make_shared<MappedWeights>();
+    mapped->path = path;
+    mapped->size = static_cast<size_t>(fileSize.QuadPart);
+
+    // The inference engine only reads the weights blob, so the read-only view can back it directly
+    TensorDesc desc(Precision::U8, { mapped->size }, Layout::C);
+    view->blob = make_shared_blob<uint8_t>(desc, static_cast<uint8_t*>(const_cast<void*>(view->data)), mapped->size);
+    // Share ownership of the view with every copy of the blob the inference engine keeps
+    mapped->blob = Blob::CPtr(view, view->blob.get());
+
+    mappedWeights[path] = mapped;
+    return mapped;
+}
+
+// Read a model, using a shared memory mapping of the weights file of IR models instead of a private copy
+// Other model formats, and IR models whose weights file cannot be mapped, are read the regular way
+// weights receives the mapping the network was read from, or an empty pointer when the weights were read into the heap
+CNNNetwork ReadModel(const std::string& modelPath, std::shared_ptr<MappedWeights>& weights) {
+    TraceScope trace("ReadModel");
+
+    // Only IR models keep their weights in a separate .bin file with the same name as the .xml file
+    size_t extension = modelPath.find_last_of('.');
+    std::string suffix = extension == std::string::npos ? "" : modelPath.substr(extension);
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    weights = suffix == ".xml" ? MapWeights(modelPath.substr(0, extension) + ".bin") : nullptr;
+    std::ifstream modelFile(modelPath);
+    if (!weights || !modelFile) {
+        weights.reset();
+        return ie.ReadNetwork(modelPath);
+    }
+
+    // Read the model topology
+    std::stringstream model;
+    model << modelFile.rdbuf();
+    return ie.ReadNetwork(model.str(), weights->blob);
+}
+
+// Set the input and output precision for a network and get the names of its input and output layers
+void ConfigureBlobs(CNNNetwork& net, std::string& inputName, std::string& outputName) {
+    // Get information about the network input
+    InputsDataMap inputInfo(net.getInputsInfo());
+    inputName = inputInfo.begin()->first;
+    inputInfo.begin()->second->setPrecision(Precision::U8);
+
+    // Get information about the network output
+    OutputsDataMap outputInfo(net.getOutputsInfo());
+    // Get the name of the output layer
+    outputName = outputInfo.begin()->first;
+    // Set the output precision
+    outputInfo.begin()->second->setPrecision(Precision::FP32);
+}
+
+// Perform shape inference on a network with new input dimensions
+void ReshapeNetwork(CNNNetwork& net, int width, int height) {
+    TraceScope trace("ReshapeNetwork");
+
+    // Collect the map of input names and shapes from IR
+    auto input_shapes = net.getInputShapes();
+
+    // Set new input shapes
+    std::string input_name;
+    InferenceEngine::SizeVector input_shape;
+    // create a tuple for accessing the input dimensions
+    std::tie(input_name, input_shape) = *input_shapes.begin();
+    // set batch size to the first input dimension
+    input_shape[0] = 1;
+    // changes input height to the image one
+    input_shape[2] = height;
+    // changes input width to the image one
+    input_shape[3] = width;
+    input_shapes[input_name] = input_shape;
+
+    // Call reshape
+    // Perform shape inference with the new input dimensions
+    net.reshape(input_shapes);
+}
+
+// Create an executable network for the target compute device along with its inference request and tensors
+std::shared_ptr<CompiledShape> CompileNetwork(const CNNNetwork& net, const std::string& deviceName, const PipelineConfig& pipeline,
+    const std::string& inputName, const std::string& outputName) {
+    TraceScope trace("CompileNetwork");
+
+    // Limit CPU inference to the configured number of threads and leave them unpinned so they share cores with the host
+    std::map<std::string, std::string> config;
+    if (pipeline.cpuThreadLimit > 0 && deviceName.find("CPU") == 0) {
+        config[CONFIG_KEY(CPU_THREADS_NUM)] = std::to_string(pipeline.cpuThreadLimit);
+        config[CONFIG_KEY(CPU_THROUGHPUT_STREAMS)] = "1";
+        config[CONFIG_KEY(CPU_BIND_THREAD)] = CONFIG_VALUE(NO);
+    }
+    // Give each stream worker its own CPU stream so their requests run in parallel
+    if (pipeline.streamWorkerCount > 1 && deviceName.find("CPU") == 0) {
+        config[CONFIG_KEY(CPU_THROUGHPUT_STREAMS)] = std::to_string(pipeline.streamWorkerCount);
+    }
+
+    auto compiled = std::make_shared<CompiledShape>();
+    // Create executable network
+    compiled->executable_network = ie.LoadNetwork(net, deviceName, config);
+    // Create an inference request object
+    compiled->infer_request = compiled->executable_network.CreateInferRequest();
+
+    // Get a poiner to the input tensor for the model
+    compiled->minput = as<MemoryBlob>(compiled->infer_request.GetBlob(inputName));
+    // Get a poiner to the ouptut tensor for the model
+    compiled->moutput = as<MemoryBlob>(compiled->infer_request.GetBlob(outputName));
+
+    // Get the dimensions of the input image
+    compiled->height = compiled->minput->getTensorDesc().getDims()[2];
+    compiled->width = compiled->minput->getTensorDesc().getDims()[3];
+    // Get the dimensions of the output planes
+    compiled->outputHeight = compiled->moutput->getTensorDesc().getDims()[2];
+    compiled->outputWidth = compiled->moutput->getTensorDesc().getDims()[3];
+    return compiled;
+}
+
+// Get the size frames are downscaled to before estimating optical flow
+cv::Size FlowSize(size_t width, size_t height) {
+    return cv::Size(std::max(static_cast<int>(width * flowScale), 1), std::max(static_cast<int>(height * flowScale), 1));
+}
+
+// Carve the scratch buffers for the enabled modes out of the arena for the given frame size
+// Called when a model is published or a mode changes, so frames never allocate
+void ReserveScratch(size_t width, size_t height) {
+    TraceScope trace("ReserveScratch");
+
+    size_t pixels = width * height;
+    cv::Size flowSize = FlowSize(width, height);
+    size_t flowPixels = static_cast<size_t>(flowSize.area());
+
+    size_t bytes = 0;
+    if (frameBudgetMs > 0.f) {
+        bytes += ScratchArena::AlignedSize(pixels * 4);
+    }
+    if (keyframeInterval > 0) {
+        bytes += ScratchArena::AlignedSize(pixels * 4) + ScratchArena::AlignedSize(pixels)
+            + ScratchArena::AlignedSize(flowPixels) * 2 + ScratchArena::AlignedSize(flowPixels * 8)
+            + ScratchArena::AlignedSize(pixels * 8) * 3;
+    }
+    scratch.Reset(bytes);
+    scratchWidth = width;
+    scratchHeight = height;
+
+    scheduler.lastOutput = frameBudgetMs > 0.f ? scratch.Allocate(pixels * 4) : nullptr;
+    scheduler.hasOutput = false;
+
+    temporal.hasKeyframe = false;
+    if (keyframeInterval > 0) {
+        int w = static_cast<int>(width);
+        int h = static_cast<int>(height);
+        temporal.keyOutput = scratch.Allocate(pixels * 4);
+        temporal.fullGray = cv::Mat(h, w, CV_8UC1, scratch.Allocate(pixels));
+        temporal.gray = cv::Mat(flowSize, CV_8UC1, scratch.Allocate(flowPixels));
+        temporal.keyGray = cv::Mat(flowSize, CV_8UC1, scratch.Allocate(flowPixels));
+        temporal.flowField = cv::Mat(flowSize, CV_32FC2, scratch.Allocate(flowPixels * 8));
+        // DIS refines the flow it is given, so start from no motion instead of whatever the arena held
+        temporal.flowField.setTo(cv::Scalar::all(0));
+        temporal.flowFull = cv::Mat(h, w, CV_32FC2, scratch.Allocate(pixels * 8));
+        temporal.grid = cv::Mat(h, w, CV_32FC2, scratch.Allocate(pixels * 8));
+        temporal.map = cv::Mat(h, w, CV_32FC2, scratch.Allocate(pixels * 8));
+
+        // Fill in the pixel coordinates of the full frame
+        for (int y = 0; y < h; y++) {
+            float* row = temporal.grid.ptr<float>(y);
+            for (int x = 0; x < w; x++) {
+                row[x * 2] = static_cast<float>(x);
+                row[x * 2 + 1] = static_cast<float>(y);
+            }
+        }
+    }
+}
+
+// Wait for the scheduler's request in flight so its inference request can be used synchronously
+void DrainScheduler() {
+    if (!scheduler.inflight) return;
+    scheduler.inflight->compiled->infer_request.Wait(IInferRequest::WaitMode::RESULT_READY);
+    scheduler.inflight.reset();
+    scheduler.resultReady = false;
+}
+
+// Release retired sessions on a background thread once nothing but the retired list holds them
+// Only the active session can be loaded by new frames, so a retired session's use count never grows again
+void ReapRetiredSessions() {
+    releasedSessions.erase(std::remove_if(releasedSessions.begin(), releasedSessions.end(), [](std::future<void>& released) {
+        return released.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), releasedSessions.end());
+
+    for (auto it = retiredSessions.begin(); it != retiredSessions.end();) {
+        if (it->use_count() > 1) {
+            ++it;
+            continue;
+        }
+        releasedSessions.push_back(std::async(std::launch::async, [previous = std::move(*it)]() mutable {
+            previous.reset();
+        }));
+        it = retiredSessions.erase(it);
+    }
+}
+
+// Make a session current and release the previous one once it is no longer in use
+void PublishSession(std::shared_ptr<ModelSession> session) {
+    // The scheduler's request in flight belongs to the previous session
+    DrainScheduler();
+    ReserveScratch(session->imageWidth, session->imageHeight);
+    std::shared_ptr<ModelSession> previous = std::atomic_exchange(&activeSession, session);
+    if (previous) retiredSessions.push_back(std::move(previous));
+    ReapRetiredSessions();
+}
+
+// Publish the current settings to the threads other than the host thread
+// Called by every setter that changes a PipelineConfig field
+void PublishPipelineConfig() {
+    auto pipeline = std::make_shared<PipelineConfig>();
+    pipeline->shapeBuckets = shapeBuckets;
+    pipeline->kernelVariant = kernelVariant;
+    pipeline->cpuThreadLimit = cpuThreadLimit;
+    pipeline->streamWorkerCount = streamWorkerCount;
+    std::atomic_store(&pipelineConfig, std::shared_ptr<const PipelineConfig>(pipeline));
+}
+
+// Get the smallest configured bucket that fits the requested size
+// The requested size is used as-is when bucketing is disabled or no bucket is large enough
+// Returns the width and height of the bucket
+std::pair<int, int> SelectBucket(const std::vector<std::pair<int, int>>& buckets, int width, int height) {
+    std::pair<int, int> selected(width, height);
+    long long bestArea = -1;
+    for (auto& bucket : buckets) {
+        if (bucket.first < width || bucket.second < height) continue;
+        long long area = static_cast<long long>(bucket.first) * bucket.second;
+        if (bestArea < 0 || area < bestArea) {
+            bestArea = area;
+            selected = bucket;
+        }
+    }
+    return selected;
+}
+
+// Round a region size up to a multiple of the region granularity
+int RoundRegionSize(int size) {
+    return (size + regionGranularity - 1) / regionGranularity * regionGranularity;
+}
+
+// Get the network compiled for an input size, compiling it the first time the size is used
+// The size is compiled outside compiledShapesMutex, so only callers that need the same size wait for it
+// Only the most recently used sizes stay cached, networks still in use are released when their last user is done
+std::shared_ptr<CompiledShape> GetCompiledShape(ModelSession& session, size_t width, size_t height) {
+    auto key = std::make_pair(width, height);
+    std::promise<std::shared_ptr<CompiledShape>> promise;
+    std::shared_future<std::shared_ptr<CompiledShape>> compiled;
+    bool compiling = false;
+    {
+        std::lock_guard<std::mutex> lock(session.compiledShapesMutex);
+        auto found = session.compiledShapes.find(key);
+        if (found == session.compiledShapes.end()) {
+            // Evict the least recently used size, never the network the session runs at its own resolution
+            // or one that is still being compiled
+            while (session.compiledShapes.size() >= maxCompiledShapes) {
+                auto oldest = session.compiledShapes.end();
+                for (auto it = session.compiledShapes.begin(); it != session.compiledShapes.end(); ++it) {
+                    if (it->second.compiled.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+                    if (session.compiled && it->second.compiled.get() == session.compiled) continue;
+                    if (oldest == session.compiledShapes.end() || it->second.lastUsed < oldest->second.lastUsed) oldest = it;
+                }
+                if (oldest == session.compiledShapes.end()) break;
+                session.compiledShapes.erase(oldest);
+            }
+
+            // Publish a placeholder so other callers for this size wait for it instead of compiling it again
+            CompiledShapeEntry entry;
+            entry.compiled = promise.get_future().share();
+            found = session.compiledShapes.emplace(key, entry).first;
+            compiling = true;
+        }
+        found->second.lastUsed = ++session.compiledShapesTick;
+        compiled = found->second.compiled;
+    }
+
+    if (compiling) {
+        try {
+            std::shared_ptr<const PipelineConfig> pipeline = std::atomic_load(&pipelineConfig);
+            // CNNNetwork copies are shallow, so the network stays locked while it has the new size
+            std::lock_guard<std::mutex> networkLock(*session.networkMutex);
+            // Compile the network at the new size, then restore the shape it had before
+            auto input_shapes = session.network.getInputShapes();
+            ReshapeNetwork(session.network, static_cast<int>(width), static_cast<int>(height));
+            std::shared_ptr<CompiledShape> result = CompileNetwork(session.network, session.deviceName, *pipeline, session.inputName, session.outputName);
+            session.network.reshape(input_shapes);
+            promise.set_value(result);
+        }
+        catch (const std::exception&) {
+            // Let the next caller try the size again instead of failing every time it is used
+            {
+                std::lock_guard<std::mutex> lock(session.compiledShapesMutex);
+                auto found = session.compiledShapes.find(key);
+                if (found != session.compiledShapes.end()) session.compiledShapes.erase(found);
+            }
+            promise.set_exception(std::current_exception());
+        }
+    }
+    return compiled.get();
+}
+
+// Compile a prepared session for width x height images, rounded up to a shape bucket
+// Zero dimensions keep the input resolution the model was read with
+void FitSession(ModelSession& session, int width, int height) {
+    if (width > 0 && height > 0) {
+        std::shared_ptr<const PipelineConfig> pipeline = std::atomic_load(&pipelineConfig);
+        int bucketWidth, bucketHeight;
+        std::tie(bucketWidth, bucketHeight) = SelectBucket(pipeline->shapeBuckets, width, height);
+        std::lock_guard<std::mutex> lock(*session.networkMutex);
+        ReshapeNetwork(session.network, bucketWidth, bucketHeight);
+    }
+
+    // Compile the network at its current input resolution
+    SizeVector input_shape;
+    {
+        std::lock_guard<std::mutex> lock(*session.networkMutex);
+        input_shape = session.network.getInputShapes().begin()->second;
+    }
+    session.compiled = GetCompiledShape(session, input_shape[3], input_shape[2]);
+    session.imageWidth = width > 0 ? width : session.compiled->width;
+    session.imageHeight = height > 0 ? height : session.compiled->height;
+}
+
+// Stop the job behind pendingSession without waiting for it
+// The job is handed to a background release so the host never blocks on a model it no longer wants
+void SupersedePendingSession() {
+    if (pendingCancelled) pendingCancelled->store(true);
+    if (pendingSession.valid()) {
+        releasedSessions.push_back(std::async(std::launch::async, [superseded = std::move(pendingSession)]() mutable {
+            try {
+                superseded.get();
+            }
+            catch (const std::exception&) {
+            }
+        }));
+    }
+    pendingCancelled = std::make_shared<std::atomic<bool>>(false);
+}
+
+// Stylize a width x height host image region, writing the result to the output image
+// The region is padded up to the input resolution of the compiled network and the output is cropped
+void InferRegion(CompiledShape& compiled, const ImageView& src, const ImageView& dst, size_t width, size_t height) {
+    {
+        TraceScope packTrace("PackInput");
+        // locked memory holder should be alive all time while access to its buffer happens
+        LockedMemory<void> ilmHolder = compiled.minput->wmap();
+
+        // Filling input tensor with image data
+        auto input_data = ilmHolder.as<PrecisionTrait<Precision::U8>::value_type*>();
+        // Drop the alpha channel and reorder the pixels into separate color planes
+        PackInput(kernelVariant, src, input_data, width, height, compiled.width, compiled.height);
+    }
+
+    {
+        TraceScope inferTrace("Infer");
+        // Perform inference
+        compiled.infer_request.Infer();
+    }
+
+    TraceScope unpackTrace("UnpackOutput");
+    // locked memory holder should be alive all time while access to its buffer happens
+    LockedMemory<const void> lmoHolder = compiled.moutput->rmap();
+    const auto output_data = lmoHolder.as<const PrecisionTrait<Precision::FP32>::value_type*>();
+
+    // Clamp the model output and write it to the output image with an opaque alpha channel
+    UnpackOutput(kernelVariant, output_data, dst, std::min(width, compiled.outputWidth), std::min(height, compiled.outputHeight), compiled.outputWidth, compiled.outputHeight);
+}
+
+// Stylize a frame in scheduler mode
+// Requests run asynchronously and the output image receives the most recent finished result
+void ScheduleInference(const std::shared_ptr<ModelSession>& session, const ImageView& src, const ImageView& dst) {
+    auto frameStart = std::chrono::steady_clock::now();
+    bool unpacked = false;
+
+    // Check whether the request in flight has finished
+    if (scheduler.inflight && !scheduler.resultReady) {
+        StatusCode status = scheduler.inflight->compiled->infer_request.Wait(IInferRequest::WaitMode::STATUS_ONLY);
+        if (status == StatusCode::OK) {
+            scheduler.resultReady = true;
+            UpdateAverage(scheduler.latencyMs, ElapsedMs(scheduler.submitTime, frameStart));
+            if (scheduler.lastCompletionTime.time_since_epoch().count() > 0) {
+                UpdateAverage(scheduler.completionIntervalMs, ElapsedMs(scheduler.lastCompletionTime, frameStart));
+            }
+            scheduler.lastCompletionTime = frameStart;
+        }
+    }
+
+    // Unpack the finished result
+    if (scheduler.resultReady) {
+        TraceScope unpackTrace("UnpackOutput");
+        CompiledShape& compiled = *scheduler.inflight->compiled;
+        size_t width = scheduler.inflight->imageWidth;
+        size_t height = scheduler.inflight->imageHeight;
+
+        // Drop results for a previous frame size
+        if (width == scratchWidth && height == scratchHeight) {
+            // locked memory holder should be alive all time while access to its buffer happens
+            LockedMemory<const void> lmoHolder = compiled.moutput->rmap();
+            const auto output_data = lmoHolder.as<const PrecisionTrait<Precision::FP32>::value_type*>();
+            ImageView lastOutput = { scheduler.lastOutput, static_cast<ptrdiff_t>(width * 4), pixelLayouts[CHANNEL_ORDER_RGBA] };
+            UnpackOutput(kernelVariant, output_data, lastOutput, std::min(width, compiled.outputWidth), std::min(height, compiled.outputHeight), compiled.outputWidth, compiled.outputHeight);
+            scheduler.hasOutput = true;
+        }
+
+        scheduler.inflight.reset();
+        scheduler.resultReady = false;
+        unpacked = true;
+        UpdateAverage(scheduler.unpackMs, ElapsedMs(frameStart, std::chrono::steady_clock::now()));
+    }
+
+    // Start a new request when the target rate allows it
+    if (!scheduler.inflight && frameStart >= scheduler.nextSubmitTime) {
+        // Postpone packing to the next frame when doing it after unpacking would exceed the budget
+        // When packing alone exceeds the budget, skip enough frames after each pack to stay within it on average
+        if ((unpacked && scheduler.unpackMs + scheduler.packMs > frameBudgetMs) || scheduler.skipFrames > 0) {
+            if (scheduler.skipFrames > 0) scheduler.skipFrames--;
+            scheduler.deferredFrames++;
+        }
+        else {
+            TraceScope packTrace("PackInput");
+            auto packStart = std::chrono::steady_clock::now();
+            CompiledShape& compiled = *session->compiled;
+            {
+                // locked memory holder should be alive all time while access to its buffer happens
+                LockedMemory<void> ilmHolder = compiled.minput->wmap();
+                auto input_data = ilmHolder.as<PrecisionTrait<Precision::U8>::value_type*>();
+                PackInput(kernelVariant, src, input_data, session->imageWidth, session->imageHeight, compiled.width, compiled.height);
+            }
+            compiled.infer_request.StartAsync();
+
+            auto now = std::chrono::steady_clock::now();
+            UpdateAverage(scheduler.packMs, ElapsedMs(packStart, now));
+            scheduler.skipFrames = std::max(static_cast<int>(std::ceil(scheduler.packMs / frameBudgetMs)) - 1, 0);
+            scheduler.inflight = session;
+            scheduler.submitTime = now;
+            if (targetInferenceRate > 0.f) {
+                auto interval = std::chrono::duration<float>(1.f / targetInferenceRate);
+                scheduler.nextSubmitTime = frameStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+            }
+        }
+    }
+
+    // Show the most recent result, or the unstylized frame until the first result is ready
+    if (scheduler.hasOutput) {
+        ImageView lastOutput = { scheduler.lastOutput, static_cast<ptrdiff_t>(session->imageWidth * 4), pixelLayouts[CHANNEL_ORDER_RGBA] };
+        CopyImage(lastOutput, dst, session->imageWidth, session->imageHeight);
+    }
+    else {
+        CopyImage(src, dst, session->imageWidth, session->imageHeight);
+    }
+
+    UpdateAverage(scheduler.hostMs, ElapsedMs(frameStart, std::chrono::steady_clock::now()));
+}
+
+// Stylize a frame in temporal mode
+// Inference only runs on keyframes, other frames warp the last stylized keyframe along the optical flow
+// Flow is estimated in memory row order, so frames are only warped when the input and output share a row order
+void TemporalInference(ModelSession& session, const ImageView& src, const ImageView& dst) {
+    int width = static_cast<int>(session.imageWidth);
+    int height = static_cast<int>(session.imageHeight);
+    cv::Mat input = MemoryMat(src, width, height);
+    cv::Mat output = MemoryMat(dst, width, height);
+
+    {
+        TraceScope flowTrace("EstimateMotion");
+        // Convert the frame to grayscale and downscale it for flow estimation
+        int code = src.layout.channels == 3 ? cv::COLOR_RGB2GRAY : src.layout.offsets[0] == 0 ? cv::COLOR_RGBA2GRAY : cv::COLOR_BGRA2GRAY;
+        cv::cvtColor(input, temporal.fullGray, code);
+        cv::resize(temporal.fullGray, temporal.gray, temporal.gray.size(), 0, 0, cv::INTER_AREA);
+    }
+
+    cv::Mat keyOutput(height, width, output.type(), temporal.keyOutput);
+    bool keyframe = !temporal.hasKeyframe || temporal.keyType != output.type() || (src.pitch < 0) != (dst.pitch < 0)
+        || temporal.framesSinceKeyframe + 1 >= keyframeInterval;
+    if (!keyframe) {
+        TraceScope flowTrace("OpticalFlow");
+        // Find where each pixel of the current frame was in the keyframe
+        // The flow of the previous frame to the same keyframe is refined as a warm start
+        temporal.flow->calc(temporal.gray, temporal.keyGray, temporal.flowField);
+        double pixels = static_cast<double>(temporal.flowField.total());
+        temporal.lastMotion = static_cast<float>(cv::norm(temporal.flowField, cv::NORM_L2) / std::sqrt(pixels) / flowScale);
+        keyframe = motionThreshold > 0.f && temporal.lastMotion > motionThreshold;
+    }
+
+    if (keyframe) {
+        InferRegion(*session.compiled, src, dst, session.imageWidth, session.imageHeight);
+        output.copyTo(keyOutput);
+        temporal.keyType = output.type();
+        std::swap(temporal.keyGray, temporal.gray);
+        temporal.hasKeyframe = true;
+        temporal.framesSinceKeyframe = 0;
+        temporal.keyframes++;
+        // The flow to the old keyframe is no warm start for the new one
+        temporal.flowField.setTo(cv::Scalar::all(0));
+        return;
+    }
+
+    TraceScope warpTrace("WarpKeyframe");
+    // Upscale the flow to full size pixels and sample the keyframe output at the displaced coordinates
+    cv::resize(temporal.flowField, temporal.flowFull, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+    cv::scaleAdd(temporal.flowFull, 1.0 / flowScale, temporal.grid, temporal.map);
+    cv::remap(keyOutput, output, temporal.map, cv::Mat(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    temporal.framesSinceKeyframe++;
+    temporal.warpedFrames++;
+}
+
+// Get the stream with the given id, empty if no such stream is registered
+std::shared_ptr<InferenceStream> FindStream(int streamId) {
+    std::lock_guard<std::mutex> lock(dispatcher.mutex);
+    if (streamId < 0 || streamId >= static_cast<int>(dispatcher.streams.size())) return nullptr;
+    return dispatcher.streams[streamId];
+}
+
+// Take the next frame to process from the stream queues, dropping frames that would finish after their deadline
+// A stream whose oldest frame would miss its deadline if it waited for another frame is served earliest deadline first,
+// as long as that keeps it within one frame of its fair share. Otherwise the frame that finishes first under weighted
+// fair queueing is served, where each frame costs its pixel count divided by the stream weight, so neither a large
+// feed nor a feed with a tight deadline can starve the others. Must be called with dispatcher.mutex held
+bool NextStreamFrame(std::shared_ptr<InferenceStream>& next, int& frameIndex) {
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<InferenceStream> urgent;
+    std::shared_ptr<InferenceStream> fair;
+
+    for (auto& stream : dispatcher.streams) {
+        if (!stream) continue;
+        // Results arriving after the deadline are not shown, so skip frames that cannot finish in time at the average service time
+        while (stream->queueCount > 0 && stream->deadlineMs > 0.f && ElapsedMs(now, stream->Front().deadline) < stream->serviceMs) {
+            stream->freeFrames.push_back(stream->Pop());
+            stream->dropped++;
+        }
+        if (stream->queueCount == 0) {
+            stream->headTagged = false;
+            continue;
+        }
+
+        // Tag the frame when it reaches the front of the queue
+        // A stream that was idle starts from the current virtual time instead of banking its unused share
+        if (!stream->headTagged) {
+            stream->headStart = std::max(dispatcher.virtualTime, stream->virtualFinish);
+            stream->headFinish = stream->headStart + static_cast<double>(stream->width) * stream->height / stream->weight;
+            stream->headTagged = true;
+        }
+
+        // Serving a frame ahead of its turn moves the stream's virtual time forward, so once a stream is more than
+        // a frame ahead of the others it waits for its fair share like any other stream
+        bool withinShare = stream->headStart <= dispatcher.virtualTime + (stream->headFinish - stream->headStart);
+        if (stream->deadlineMs > 0.f && withinShare && ElapsedMs(now, stream->Front().deadline) <= 2.f * stream->serviceMs) {
+            if (!urgent || stream->Front().deadline < urgent->Front().deadline) urgent = stream;
+        }
+        if (!fair || stream->headFinish < fair->headFinish) fair = stream;
+    }
+    if (!fair) return false;
+
+    next = urgent ? urgent : fair;
+    // Frames served early for their deadline still count against the stream's fair share
+    next->virtualFinish = next->headFinish;
+    if (!urgent) dispatcher.virtualTime = next->headStart;
+    next->headTagged = false;
+    frameIndex = next->Pop();
+    return true;
+}
+
+// Get the worker's inference request for a compiled network, creating it the first time the network is used
+PooledRequest& GetPooledRequest(std::vector<PooledRequest>& requests, const ModelSession& session, const std::shared_ptr<CompiledShape>& compiled) {
+    // Release requests for networks no session uses anymore
+    requests.erase(std::remove_if(requests.begin(), requests.end(), [&](const PooledRequest& pooled) {
+        return pooled.compiled != compiled && pooled.compiled.use_count() == 1;
+    }), requests.end());
+
+    for (auto& pooled : requests) {
+        if (pooled.compiled == compiled) return pooled;
+    }
+
+    PooledRequest pooled;
+    pooled.compiled = compiled;
+    pooled.request = compiled->executable_network.CreateInferRequest();
+    pooled.minput = as<MemoryBlob>(pooled.request.GetBlob(session.inputName));
+    pooled.moutput = as<MemoryBlob>(pooled.request.GetBlob(session.outputName));
+    requests.push_back(pooled);
+    return requests.back();
+}
+
+// Process frames from the stream queues until the dispatcher stops
+void ProcessStreamFrames() {
+    std::vector<PooledRequest> requests;
+
+    while (true) {
+        std::shared_ptr<InferenceStream> stream;
+        int frameIndex = -1;
+        {
+            std::unique_lock<std::mutex> lock(dispatcher.mutex);
+            dispatcher.frameQueued.wait(lock, [&]() { return !dispatcher.running || NextStreamFrame(stream, frameIndex); });
+            if (!dispatcher.running) break;
+        }
+
+        // The frame buffer belongs to this worker until it is returned to the free list
+        auto start = std::chrono::steady_clock::now();
+        StreamFrame& frame = stream->frames[frameIndex];
+        // Hold a reference to the session so a model swap cannot release it mid-frame
+        std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession);
+        if (session) {
+            // Stamp the events with the stream's frame instead of the host's PerformInference frame
+            TraceStreamFrame traceFrame(stream->id, static_cast<uint64_t>(frame.sequence));
+            TraceScope trace("StreamInference");
+            std::shared_ptr<const PipelineConfig> pipeline = std::atomic_load(&pipelineConfig);
+            int bucketWidth, bucketHeight;
+            std::tie(bucketWidth, bucketHeight) = SelectBucket(pipeline->shapeBuckets, stream->width, stream->height);
+            std::shared_ptr<CompiledShape> compiled = GetCompiledShape(*session, bucketWidth, bucketHeight);
+            PooledRequest& pooled = GetPooledRequest(requests, *session, compiled);
+
+            size_t width = stream->width;
+            size_t height = stream->height;
+            {
+                TraceScope packTrace("PackInput");
+                // locked memory holder should be alive all time while access to its buffer happens
+                LockedMemory<void> ilmHolder = pooled.minput->wmap();
+                auto input_data = ilmHolder.as<PrecisionTrait<Precision::U8>::value_type*>();
+                ImageView src = { frame.pixels.data(), static_cast<ptrdiff_t>(width * frame.layout.channels), frame.layout };
+                PackInput(pipeline->kernelVariant, src, input_data, width, height, compiled->width, compiled->height);
+            }
+
+            {
+                TraceScope inferTrace("Infer");
+                pooled.request.Infer();
+            }
+
+            TraceScope unpackTrace("UnpackOutput");
+            std::lock_guard<std::mutex> resultLock(stream->resultMutex);
+            // Another worker may have already finished a newer frame of the same stream
+            if (frame.sequence > stream->resultSequence) {
+                // locked memory holder should be alive all time while access to its buffer happens
+                LockedMemory<const void> lmoHolder = pooled.moutput->rmap();
+                const auto output_data = lmoHolder.as<const PrecisionTrait<Precision::FP32>::value_type*>();
+                ImageView dst = { stream->result.data(), static_cast<ptrdiff_t>(width * 4), pixelLayouts[CHANNEL_ORDER_RGBA] };
+                UnpackOutput(pipeline->kernelVariant, output_data, dst, std::min(width, compiled->outputWidth), std::min(height, compiled->outputHeight), compiled->outputWidth, compiled->outputHeight);
+                stream->resultSequence = frame.sequence;
+            }
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        if (session) {
+            float latency = ElapsedMs(frame.submitTime, end);
+            stream->completed++;
+            UpdateAverage(stream->latencyMs, latency);
+            stream->maxLatencyMs = std::max(stream->maxLatencyMs, latency);
+            if (stream->deadlineMs > 0.f && end > frame.deadline) stream->lateFrames++;
+            UpdateAverage(stream->serviceMs, ElapsedMs(start, end));
+        }
+        else {
+            stream->dropped++;
+        }
+        stream->freeFrames.push_back(frameIndex);
+    }
+}
+
+// Run a stream worker thread, which holds a reference to the plugin module
+// The plugin stays loaded while workers are blocked in it, even if the host unloads it without StopStreamDispatcher
+void StreamWorker(HMODULE module) {
+    ProcessStreamFrames();
+    // Release the reference without returning into plugin code that may be unloaded by then
+    if (module) FreeLibraryAndExitThread(module, 0);
+}
+
+// Wrap code to prevent name-mangling issues
+extern "C" {
 
     // Returns an unparsed list of available compute devices
     DLLExport const std::string* GetAvailableDevices() {
@@ -53,38 +1776,21 @@ extern "C" {
         return &allDevices;
     }
 
-    // Configure the cache directory for GPU compute devices
-    void SetDeviceCache() {
-        std::regex e("(GPU)(.*)");
-        // Iterate through the available compute devices
-        for (auto&& device : availableDevices) {
-            // Only configure the cache directory for GPUs
-            if (std::regex_match(device, e)) {
-                ie.SetConfig({ {CONFIG_KEY(CACHE_DIR), "cache"} }, device);
-            }
-        }
-    }
-
     // Get the names of the input and output layers and set the precision
     DLLExport void PrepareBlobs() {
-        // Get information about the network input
-        InputsDataMap inputInfo(network.getInputsInfo());
-        firstInputName = inputInfo.begin()->first;
-        inputInfo.begin()->second->setPrecision(Precision::U8);
-
-        // Get information about the network output
-        OutputsDataMap outputInfo(network.getOutputsInfo());
-        // Get the name of the output layer
-        firstOutputName = outputInfo.begin()->first;
-        // Set the output precision
-        outputInfo.begin()->second->setPrecision(Precision::FP32);
+        std::lock_guard<std::mutex> lock(*networkMutex);
+        ConfigureBlobs(network, firstInputName, firstOutputName);
     }
 
     // Set up OpenVINO inference engine
     DLLExport void InitializeOpenVINO(char* modelPath) {
+        TraceScope trace("InitializeOpenVINO");
 
         // Read network file
-        network = ie.ReadNetwork(modelPath);
+        network = ReadModel(modelPath, networkWeights);
+        // The new network is not shared with any session yet
+        networkMutex = std::make_shared<std::mutex>();
+        modelGeneration++;
         // Set batch size to one image
         network.setBatchSize(1);
         // Get the output name and set the output precision
@@ -99,105 +1805,613 @@ extern "C" {
 
     // Manually set the input resolution for the model
     DLLExport void SetInputDims(int width, int height) {
+        requestedWidth = width;
+        requestedHeight = height;
 
-        // Collect the map of input names and shapes from IR
-        auto input_shapes = network.getInputShapes();
-
-        // Set new input shapes
-        std::string input_name;
-        InferenceEngine::SizeVector input_shape;
-        // create a tuple for accessing the input dimensions
-        std::tie(input_name, input_shape) = *input_shapes.begin();
-        // set batch size to the first input dimension
-        input_shape[0] = 1;
-        // changes input height to the image one
-        input_shape[2] = height;
-        // changes input width to the image one
-        input_shape[3] = width;
-        input_shapes[input_name] = input_shape;
-
-        // Call reshape
-        // Perform shape inference with the new input dimensions
-        network.reshape(input_shapes);
-        // Initialize the texture variable with the new dimensions
-        texture = cv::Mat(height, width, CV_8UC4);
+        // Round the dimensions up to a configured bucket
+        int bucketWidth, bucketHeight;
+        std::tie(bucketWidth, bucketHeight) = SelectBucket(shapeBuckets, width, height);
+        // The active session may share the network with stream workers compiling other sizes
+        std::lock_guard<std::mutex> lock(*networkMutex);
+        ReshapeNetwork(network, bucketWidth, bucketHeight);
     }
 
     // Create an executable network for the target compute device
     DLLExport std::string* UploadModelToDevice(int deviceNum) {
+        TraceScope trace("UploadModelToDevice");
 
-        // Create executable network
-        executable_network = ie.LoadNetwork(network, availableDevices[deviceNum]);
-        // Create an inference request object
-        infer_request = executable_network.CreateInferRequest();
-
-        // Get a poiner to the input tensor for the model
-        minput = as<MemoryBlob>(infer_request.GetBlob(firstInputName));
-        // Get a poiner to the ouptut tensor for the model
-        moutput = as<MemoryBlob>(infer_request.GetBlob(firstOutputName));
+        auto session = std::make_shared<ModelSession>();
+        session->network = network;
+        session->networkMutex = networkMutex;
+        session->weights = networkWeights;
+        session->inputName = firstInputName;
+        session->outputName = firstOutputName;
+        session->deviceNum = deviceNum;
+        session->deviceName = availableDevices[deviceNum];
+        session->modelGeneration = modelGeneration;
 
-        // Get the number of color channels 
-        num_channels = minput->getTensorDesc().getDims()[1];
-        // Get the number of pixels in the input image
-        size_t H = minput->getTensorDesc().getDims()[2];
-        size_t W = minput->getTensorDesc().getDims()[3];
-        nPixels = W * H;
+        // Reuse the networks already compiled for this model and compute device
+        auto previous = std::atomic_load(&activeSession);
+        if (previous && previous->modelGeneration == modelGeneration && previous->deviceNum == deviceNum) {
+            std::lock_guard<std::mutex> lock(previous->compiledShapesMutex);
+            session->compiledShapes = previous->compiledShapes;
+        }
 
-        // Filling input tensor with image data
-        data_img = std::vector<float>(nPixels * num_channels);
+        // Compile the network at its current input resolution
+        SizeVector input_shape;
+        {
+            std::lock_guard<std::mutex> lock(*networkMutex);
+            input_shape = network.getInputShapes().begin()->second;
+        }
+        session->compiled = GetCompiledShape(*session, input_shape[3], input_shape[2]);
+        // Only the requested part of a padded input holds image data
+        session->imageWidth = requestedWidth > 0 ? std::min<size_t>(requestedWidth, session->compiled->width) : session->compiled->width;
+        session->imageHeight = requestedHeight > 0 ? std::min<size_t>(requestedHeight, session->compiled->height) : session->compiled->height;
+        PublishSession(session);
 
         // Return the name of the current compute device
-        return &availableDevices[deviceNum];;
+        return &availableDevices[deviceNum];
+    }
+
+    // Read and compile a model in the background at the current input resolution
+    // The model replaces the current one when SwapModel is called after it is ready
+    DLLExport void PrepareModel(char* modelPath, int deviceNum) {
+        // Use the requested input resolution, or that of the current model
+        auto current = std::atomic_load(&activeSession);
+        int width = requestedWidth > 0 ? requestedWidth : current ? static_cast<int>(current->imageWidth) : 0;
+        int height = requestedHeight > 0 ? requestedHeight : current ? static_cast<int>(current->imageHeight) : 0;
+        std::string path(modelPath);
+        std::string deviceName = availableDevices[deviceNum];
+
+        // Stop preparing any earlier model instead of waiting for it
+        SupersedePendingSession();
+        ReapRetiredSessions();
+        pendingSession = std::async(std::launch::async, [path, deviceNum, deviceName, width, height, cancelled = pendingCancelled]() -> std::shared_ptr<ModelSession> {
+            TraceScope trace("PrepareModel");
+
+            auto session = std::make_shared<ModelSession>();
+            session->networkMutex = std::make_shared<std::mutex>();
+            // Read network file
+            session->network = ReadModel(path, session->weights);
+            // Set batch size to one image
+            session->network.setBatchSize(1);
+            ConfigureBlobs(session->network, session->inputName, session->outputName);
+            session->deviceNum = deviceNum;
+            session->deviceName = deviceName;
+
+            // Skip compiling a model that was superseded while it was being read
+            if (cancelled->load()) return nullptr;
+            FitSession(*session, width, height);
+            return session;
+        });
+    }
+
+    // Replace the current model with the one from PrepareModel once it is ready
+    // Returns 1 if the model was swapped, 0 if it is still being prepared and -1 if preparing it failed
+    // A model prepared for other dimensions than the last SetInputDims call is recompiled in the background first
+    DLLExport int SwapModel() {
+        if (!pendingSession.valid()) return -1;
+        if (pendingSession.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return 0;
+
+        std::shared_ptr<ModelSession> session;
+        try {
+            session = pendingSession.get();
+        }
+        catch (const std::exception&) {
+            return -1;
+        }
+        if (!session) return -1;
+
+        // Recompile at the requested resolution if it changed while the model was being prepared
+        if (requestedWidth > 0 && requestedHeight > 0 &&
+            (session->imageWidth != static_cast<size_t>(requestedWidth) || session->imageHeight != static_cast<size_t>(requestedHeight))) {
+            int width = requestedWidth;
+            int height = requestedHeight;
+            pendingSession = std::async(std::launch::async, [session, width, height, cancelled = pendingCancelled]() -> std::shared_ptr<ModelSession> {
+                TraceScope trace("PrepareModel");
+                if (cancelled->load()) return nullptr;
+                FitSession(*session, width, height);
+                return session;
+            });
+            return 0;
+        }
+
+        // Keep SetInputDims and UploadModelToDevice working with the new model
+        network = session->network;
+        networkMutex = session->networkMutex;
+        networkWeights = session->weights;
+        session->modelGeneration = ++modelGeneration;
+        firstInputName = session->inputName;
+        firstOutputName = session->outputName;
+
+        PublishSession(session);
+        // Start temporal mode over with a keyframe from the new model
+        temporal.hasKeyframe = false;
+        return 1;
+    }
+
+    // Set the input sizes that requested dimensions are rounded up to
+    // dims holds a width and height for each bucket, passing zero buckets disables bucketing
+    // Takes effect the next time SetInputDims, PrepareModel or PerformInferenceROI picks an input size
+    DLLExport void SetShapeBuckets(int* dims, int numBuckets) {
+        shapeBuckets.clear();
+        for (int i = 0; i < numBuckets; i++) {
+            shapeBuckets.emplace_back(dims[i * 2], dims[i * 2 + 1]);
+        }
+        PublishPipelineConfig();
+    }
+
+    // Compile the current model for every configured bucket ahead of time
+    // Returns the number of input sizes compiled for the current model
+    DLLExport int PrecompileShapeBuckets() {
+        TraceScope trace("PrecompileShapeBuckets");
+
+        auto session = std::atomic_load(&activeSession);
+        if (!session) return 0;
+
+        for (auto& bucket : shapeBuckets) {
+            GetCompiledShape(*session, bucket.first, bucket.second);
+        }
+        std::lock_guard<std::mutex> lock(session->compiledShapesMutex);
+        return static_cast<int>(session->compiledShapes.size());
+    }
+
+    // Returns the extra pixels processed for padding as a fraction of the image size for the current model
+    DLLExport float GetPaddingOverhead() {
+        auto session = std::atomic_load(&activeSession);
+        if (!session || session->imageWidth == 0 || session->imageHeight == 0) return 0.f;
+
+        double imageArea = static_cast<double>(session->imageWidth) * session->imageHeight;
+        double inputArea = static_cast<double>(session->compiled->width) * session->compiled->height;
+        return static_cast<float>((inputArea - imageArea) / imageArea);
+    }
+
+    // Enable scheduler mode, where inference runs asynchronously and PerformInference returns the latest finished frame
+    // budgetMs is the host thread time per frame the plugin may use and targetRate caps the requests started per second
+    // threadLimit caps the CPU threads used by inference, with zero leaving one hardware thread free for the host
+    // Passing a budget of zero disables scheduler mode. The thread limit applies the next time a model is uploaded
+    DLLExport void SetFrameBudget(float budgetMs, float targetRate, int threadLimit) {
+        DrainScheduler();
+        scheduler = FrameScheduler();
+        frameBudgetMs = std::max(budgetMs, 0.f);
+        targetInferenceRate = std::max(targetRate, 0.f);
+
+        int threads = 0;
+        if (frameBudgetMs > 0.f) {
+            threads = threadLimit > 0 ? threadLimit : std::max(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1);
+        }
+        if (threads != cpuThreadLimit) {
+            cpuThreadLimit = threads;
+            // Networks compiled with the previous thread limit can no longer be reused
+            modelGeneration++;
+            PublishPipelineConfig();
+        }
+
+        if (auto session = std::atomic_load(&activeSession)) ReserveScratch(session->imageWidth, session->imageHeight);
+    }
+
+    // Get the scheduler statistics
+    DLLExport void GetSchedulerStats(SchedulerStats* stats) {
+        stats->budgetMs = frameBudgetMs;
+        stats->hostMs = scheduler.hostMs;
+        stats->targetRate = targetInferenceRate;
+        stats->achievedRate = scheduler.completionIntervalMs > 0.f ? 1000.f / scheduler.completionIntervalMs : 0.f;
+        stats->latencyMs = scheduler.latencyMs;
+        stats->deferredFrames = scheduler.deferredFrames;
+    }
+
+    // Get the memory used by the process and the weights files it has mapped
+    DLLExport void GetMemoryUsage(MemoryUsage* usage) {
+        PROCESS_MEMORY_COUNTERS_EX counters = {};
+        counters.cb = sizeof(counters);
+        GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters));
+        usage->workingSetBytes = counters.WorkingSetSize;
+        usage->privateBytes = counters.PrivateUsage;
+
+        usage->mappedWeightsBytes = 0;
+        std::lock_guard<std::mutex> lock(mappedWeightsMutex);
+        for (auto& entry : mappedWeights) {
+            if (auto weights = entry.second.lock()) usage->mappedWeightsBytes += weights->size;
+        }
+    }
+
+    // Enable temporal mode, where inference only runs every keyframeInterval frames or when motion exceeds motionThreshold
+    // Frames in between are produced by warping the last stylized frame along the estimated optical flow
+    // A threshold of zero or less disables the motion trigger, so keyframes only happen every keyframeInterval frames
+    // scale sets the size flow is estimated at, preset picks the DIS optical flow preset (0 ultrafast, 1 fast, 2 medium)
+    // Passing a keyframe interval of zero or one disables temporal mode. Scheduler mode takes precedence when both are enabled
+    DLLExport void SetTemporalMode(int interval, float threshold, float scale, int preset) {
+        keyframeInterval = interval > 1 ? interval : 0;
+        motionThreshold = threshold;
+        flowScale = std::min(std::max(scale, 0.05f), 1.f);
+        temporal = TemporalState();
+        if (keyframeInterval > 0) {
+            temporal.flow = cv::DISOpticalFlow::create(std::min(std::max(preset, 0), 2));
+        }
+
+        if (auto session = std::atomic_load(&activeSession)) ReserveScratch(session->imageWidth, session->imageHeight);
+    }
+
+    // Get the number of keyframes and warped frames produced in temporal mode and the motion of the last frame
+    DLLExport void GetTemporalStats(int* keyframes, int* warpedFrames, float* lastMotion) {
+        *keyframes = temporal.keyframes;
+        *warpedFrames = temporal.warpedFrames;
+        *lastMotion = temporal.lastMotion;
+    }
+
+    // Get the number of heap allocations made by plugin code and OpenCV Mats during the last frame and since the plugin was loaded
+    // Once a model is uploaded and the modes are configured, frames are expected to make no allocations
+    DLLExport void GetAllocationStats(AllocationStats* stats) {
+        stats->frameCount = lastFrameAllocations;
+        stats->frameBytes = lastFrameAllocatedBytes;
+        stats->totalCount = allocationCount.load();
+        stats->totalBytes = allocatedBytes.load();
+    }
+
+    // Turn recording of per-frame pipeline events on or off
+    DLLExport void SetTracing(bool enabled) {
+        tracingEnabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    // Write the recorded events to the specified file in the Chrome trace event format
+    // Returns the number of events written, or -1 if the file could not be opened
+    DLLExport int DumpTrace(char* tracePath) {
+        std::ofstream file(tracePath);
+        if (!file) return -1;
+
+        int count = 0;
+        file << "{\"traceEvents\":[";
+        std::lock_guard<std::mutex> lock(traceBuffersMutex);
+        for (auto& buffer : traceBuffers) {
+            // Buffers handed back by exited threads are dumped once before a new thread may take them over
+            if (buffer->reusable) continue;
+            bool retired = buffer->retired.load(std::memory_order_acquire);
+            uint64_t end = buffer->head.load(std::memory_order_acquire);
+            uint64_t begin = end > TraceBuffer::capacity ? end - TraceBuffer::capacity : 0;
+            for (uint64_t i = begin; i < end; i++) {
+                TraceEvent event = buffer->events[i % TraceBuffer::capacity];
+                // Skip events the owning thread overwrote or is overwriting while they were being copied
+                // The slot of event i is reused by event i + capacity, which is written before head moves past it
+                std::atomic_thread_fence(std::memory_order_acquire);
+                uint64_t head = buffer->head.load(std::memory_order_relaxed);
+                if (i + TraceBuffer::capacity <= head) continue;
+
+                file << (count++ ? "," : "") << "\n{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase
+                    << "\",\"ts\":" << event.timestamp << ",\"pid\":" << GetCurrentProcessId()
+                    << ",\"tid\":" << buffer->threadId << ",\"args\":{\"frame\":" << event.frameId;
+                if (event.streamId >= 0) file << ",\"stream\":" << event.streamId;
+                file << "}}";
+            }
+            if (retired) buffer->reusable = true;
+        }
+        file << "\n]}\n";
+        return count;
+    }
+
+    // Select the implementation used to pack the input tensor and unpack the model output
+    DLLExport void SetKernelVariant(int variant) {
+        if (variant >= KERNEL_SCALAR && variant < KERNEL_COUNT) kernelVariant = variant;
+        PublishPipelineConfig();
+    }
+
+    // Check the kernel variants against the scalar reference and measure their throughput in GB/s
+    // throughput must hold 2 * KERNEL_COUNT values: the packing results followed by the unpacking results
+    // minThroughput holds the lowest acceptable value for each of those results, or is null to skip the throughput checks
+    // Returns the number of failed checks, counting mismatched output and results below their minimum
+    // Returns -1 without running any checks when the size or the iteration count is not positive or throughput is null
+    DLLExport int ValidateKernels(int width, int height, int iterations, const float* minThroughput, float* throughput) {
+        if (width <= 0 || height <= 0 || iterations <= 0 || !throughput) return -1;
+
+        // Use a fixed seed so failures can be reproduced
+        std::mt19937 rng(42);
+        int failures = 0;
+
+        // Check the requested size along with odd widths that exercise the scalar tails and padded planes
+        const int sizes[][4] = {
+            {width, height, width, height}, {1, 1, 1, 1}, {15, 3, 15, 3}, {17, 5, 17, 5}, {33, 7, 33, 7},
+            {1, 1, 16, 4}, {17, 5, 32, 8}, {33, 7, 35, 7}
+        };
+        for (auto& size : sizes) {
+            // Check every channel order with top-down and bottom-up rows
+            for (int order = 0; order < CHANNEL_ORDER_COUNT; order++) {
+                for (int flip = 0; flip < 2; flip++) {
+                    if (!CheckKernels(size[0], size[1], size[2], size[3], order, flip != 0, rng)) failures++;
+                }
+            }
+        }
+
+        // Time each variant at the requested size
+        size_t nPixels = static_cast<size_t>(width) * height;
+        std::vector<uchar> rgba(nPixels * 4, 128);
+        std::vector<uchar> packed(nPixels * 3);
+        std::vector<float> planar(nPixels * 3, 128.f);
+        ImageView image = MakeImageView(rgba.data(), nullptr, width, height);
+        for (int variant = KERNEL_SCALAR; variant < KERNEL_COUNT; variant++) {
+            // Run one untimed pass so thread pool startup and cold caches are not measured
+            PackInput(variant, image, packed.data(), width, height, width, height);
+            UnpackOutput(variant, planar.data(), image, width, height, width, height);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                PackInput(variant, image, packed.data(), width, height, width, height);
+            }
+            auto mid = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                UnpackOutput(variant, planar.data(), image, width, height, width, height);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+
+            // Count the bytes read plus the bytes written by each pass
+            double packBytes = static_cast<double>(nPixels) * (4 + 3) * iterations;
+            double unpackBytes = static_cast<double>(nPixels) * (3 * sizeof(float) + 4) * iterations;
+            double packSeconds = std::chrono::duration<double>(mid - start).count();
+            double unpackSeconds = std::chrono::duration<double>(end - mid).count();
+            throughput[variant] = static_cast<float>(packBytes / packSeconds / 1e9);
+            throughput[KERNEL_COUNT + variant] = static_cast<float>(unpackBytes / unpackSeconds / 1e9);
+
+            if (minThroughput && throughput[variant] < minThroughput[variant]) failures++;
+            if (minThroughput && throughput[KERNEL_COUNT + variant] < minThroughput[KERNEL_COUNT + variant]) failures++;
+        }
+        return failures;
+    }
+
+    // Perform inference reading from and writing to host buffers with the given layouts
+    // Both buffers hold images at the SetInputDims resolution and may be the same buffer
+    // A null descriptor means a tightly packed top-down RGBA buffer
+    DLLExport void PerformInferenceEx(uchar* inputData, const BufferDesc* inputDesc, uchar* outputData, const BufferDesc* outputDesc) {
+        // Start a new frame for the trace events
+        traceFrameId.fetch_add(1, std::memory_order_relaxed);
+        TraceScope trace("PerformInference");
+        FrameAllocationScope allocations;
+        // Release sessions the previous frames were still using when they were replaced
+        if (!retiredSessions.empty() || !releasedSessions.empty()) ReapRetiredSessions();
+
+        // Hold a reference to the session so a model swap cannot release it mid-frame
+        std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession);
+        if (!session) return;
+        // Only happens if the scratch buffers were carved for a different session
+        if (session->imageWidth != scratchWidth || session->imageHeight != scratchHeight) {
+            ReserveScratch(session->imageWidth, session->imageHeight);
+        }
+
+        ImageView src = MakeImageView(inputData, inputDesc, session->imageWidth, session->imageHeight);
+        ImageView dst = MakeImageView(outputData, outputDesc, session->imageWidth, session->imageHeight);
+        if (frameBudgetMs > 0.f) {
+            ScheduleInference(session, src, dst);
+            return;
+        }
+        if (keyframeInterval > 0) {
+            TemporalInference(*session, src, dst);
+            return;
+        }
+
+        InferRegion(*session->compiled, src, dst, session->imageWidth, session->imageHeight);
     }
 
     // Perform inference with the provided texture data
     DLLExport void PerformInference(uchar* inputData) {
+        PerformInferenceEx(inputData, nullptr, inputData, nullptr);
+    }
 
-        // Assign the inputData to the OpenCV Mat
-        texture.data = inputData;
-        // Remove the alpha channel
-        cv::cvtColor(texture, texture, cv::COLOR_RGBA2RGB);
+    // Check that frames make no heap allocations once the pipeline is warmed up
+    // Runs warmupFrames frames through PerformInference with the current modes, then counts the allocations made
+    // by the next frames. Returns that count, which should be zero, or -1 if no model is uploaded
+    DLLExport int CheckSteadyStateAllocations(int warmupFrames, int frames) {
+        std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession);
+        if (!session) return -1;
 
-        // locked memory holder should be alive all time while access to its buffer happens
-        LockedMemory<void> ilmHolder = minput->wmap();
+        // A flat gray frame, allocated before counting starts
+        std::vector<uchar> frame(session->imageWidth * session->imageHeight * 4, 128);
+        for (int i = 0; i < warmupFrames; i++) {
+            PerformInference(frame.data());
+        }
 
-        // Filling input tensor with image data
-        auto input_data = ilmHolder.as<PrecisionTrait<Precision::U8>::value_type*>();
+        // Only count this thread, so stream workers and background compiles do not show up as frame allocations
+        uint64_t startCount = threadAllocationCount;
+        for (int i = 0; i < frames; i++) {
+            PerformInference(frame.data());
+        }
+        return static_cast<int>(threadAllocationCount - startCount);
+    }
 
-        // Iterate over each pixel in image
-        for (size_t p = 0; p < nPixels; p++) {
-            // Iterate over each color channel for each pixel in image
-            for (size_t ch = 0; ch < num_channels; ++ch) {
-                input_data[ch * nPixels + p] = texture.data[p * num_channels + ch];
-            }
+    // Perform inference on regions of an RGBA image, leaving the rest of the image untouched
+    // Regions are clipped to the image and processed in order, so later regions see the output of earlier ones
+    // Returns the number of regions processed
+    DLLExport int PerformInferenceROI(uchar* inputData, int imageWidth, int imageHeight, ImageRect* rects, int numRects) {
+        // Start a new frame for the trace events
+        traceFrameId.fetch_add(1, std::memory_order_relaxed);
+        TraceScope trace("PerformInferenceROI");
+        FrameAllocationScope allocations;
+
+        // Hold a reference to the session so a model swap cannot release it mid-frame
+        std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession);
+        if (!session) return 0;
+        // Regions run synchronously and may share the scheduler's inference request
+        DrainScheduler();
+
+        int processed = 0;
+        size_t pitch = static_cast<size_t>(imageWidth) * 4;
+        for (int i = 0; i < numRects; i++) {
+            // Clip the region to the image
+            int x0 = std::max(rects[i].x, 0);
+            int y0 = std::max(rects[i].y, 0);
+            int x1 = std::min(rects[i].x + rects[i].width, imageWidth);
+            int y1 = std::min(rects[i].y + rects[i].height, imageHeight);
+            if (x1 <= x0 || y1 <= y0) continue;
+
+            // Round the region size up to the region granularity, then to a configured bucket
+            int bucketWidth, bucketHeight;
+            std::tie(bucketWidth, bucketHeight) = SelectBucket(shapeBuckets, RoundRegionSize(x1 - x0), RoundRegionSize(y1 - y0));
+            std::shared_ptr<CompiledShape> compiled = GetCompiledShape(*session, bucketWidth, bucketHeight);
+            ImageView region = { inputData + y0 * pitch + x0 * 4, static_cast<ptrdiff_t>(pitch), pixelLayouts[CHANNEL_ORDER_RGBA] };
+            InferRegion(*compiled, region, region, x1 - x0, y1 - y0);
+            processed++;
         }
+        return processed;
+    }
 
-        // Perform inference
-        infer_request.Infer();
+    // Stop the stream workers, leaving queued frames in their queues
+    DLLExport void StopStreamDispatcher() {
+        {
+            std::lock_guard<std::mutex> lock(dispatcher.mutex);
+            dispatcher.running = false;
+        }
+        dispatcher.frameQueued.notify_all();
+        for (auto& worker : dispatcher.workers) {
+            worker.join();
+        }
+        dispatcher.workers.clear();
+    }
 
-        // locked memory holder should be alive all time while access to its buffer happens
-        LockedMemory<const void> lmoHolder = moutput->rmap();
-        const auto output_data = lmoHolder.as<const PrecisionTrait<Precision::FP32>::value_type*>();
+    // Start the threads that process frames submitted to streams, each with its own inference requests
+    // Passing zero uses the number of requests the compute device runs best with
+    // CPU networks are compiled with one CPU stream per worker the next time a model is uploaded
+    // Returns the number of workers started
+    DLLExport int StartStreamDispatcher(int numWorkers) {
+        StopStreamDispatcher();
+
+        if (numWorkers <= 0) {
+            std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession);
+            numWorkers = session ? static_cast<int>(session->compiled->executable_network.GetMetric(METRIC_KEY(OPTIMAL_NUMBER_OF_INFER_REQUESTS)).as<unsigned int>()) : 1;
+            numWorkers = std::max(numWorkers, 1);
+        }
+        if (numWorkers != streamWorkerCount) {
+            streamWorkerCount = numWorkers;
+            // Networks compiled for a different number of CPU streams can no longer be reused
+            modelGeneration++;
+            PublishPipelineConfig();
+        }
+
+        dispatcher.running = true;
+        for (int i = 0; i < numWorkers; i++) {
+            HMODULE module = nullptr;
+            GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCSTR>(&StreamWorker), &module);
+            dispatcher.workers.emplace_back(StreamWorker, module);
+        }
+        return numWorkers;
+    }
+
+    // Register a feed of width x height frames and get its stream id
+    // weight sets the stream's share of inference time relative to other streams
+    // deadlineMs is how long after submission a result is still useful, frames that would finish later are dropped
+    // queueDepth is the number of frames that can wait, submitting to a full queue drops the oldest frame
+    DLLExport int RegisterStream(int width, int height, float weight, float deadlineMs, int queueDepth) {
+        auto stream = std::make_shared<InferenceStream>();
+        stream->width = width;
+        stream->height = height;
+        stream->weight = weight > 0.f ? weight : 1.f;
+        stream->deadlineMs = std::max(deadlineMs, 0.f);
+        stream->queue.resize(std::max(queueDepth, 1));
+        // One more frame than the queue holds so a worker can process a frame while the queue is full
+        stream->frames.resize(stream->queue.size() + 1);
+        for (size_t i = 0; i < stream->frames.size(); i++) {
+            stream->frames[i].pixels.resize(static_cast<size_t>(width) * height * 4);
+            stream->freeFrames.push_back(static_cast<int>(i));
+        }
+        stream->result.resize(static_cast<size_t>(width) * height * 4);
+
+        // Compile the network for the stream's input size now instead of on its first frame
+        if (std::shared_ptr<ModelSession> session = std::atomic_load(&activeSession)) {
+            std::pair<int, int> bucket = SelectBucket(shapeBuckets, width, height);
+            GetCompiledShape(*session, bucket.first, bucket.second);
+        }
+
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        stream->virtualFinish = dispatcher.virtualTime;
+        stream->id = static_cast<int>(dispatcher.streams.size());
+        dispatcher.streams.push_back(stream);
+        return static_cast<int>(dispatcher.streams.size()) - 1;
+    }
 
-        // Iterate through each pixel in the model output
-        for (size_t p = 0; p < nPixels; p++) {
-            // Iterate through each color channel for each pixel in image
-            for (size_t ch = 0; ch < num_channels; ++ch) {
-                // Get values from the model output
-                data_img[p * num_channels + ch] = static_cast<float>(output_data[ch * nPixels + p]);
+    // Remove a stream, dropping its queued frames
+    DLLExport void UnregisterStream(int streamId) {
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        if (streamId < 0 || streamId >= static_cast<int>(dispatcher.streams.size())) return;
+        dispatcher.streams[streamId].reset();
+    }
 
-                // Clamp color values to the range [0, 255]
-                if (data_img[p * num_channels + ch] < 0) data_img[p * num_channels + ch] = 0;
-                if (data_img[p * num_channels + ch] > 255) data_img[p * num_channels + ch] = 255;
+    // Copy a frame into a stream's queue for the stream workers to stylize
+    // A null descriptor means a tightly packed top-down RGBA buffer
+    // Returns the frame's sequence number, or zero if the stream does not exist or the frame was dropped
+    DLLExport int SubmitStreamFrame(int streamId, uchar* inputData, const BufferDesc* inputDesc) {
+        std::shared_ptr<InferenceStream> stream = FindStream(streamId);
+        if (!stream) return 0;
 
-                // Copy the processed output to the OpenCV Mat
-                texture.data[p * num_channels + ch] = data_img[p * num_channels + ch];
+        int frameIndex = -1;
+        {
+            std::lock_guard<std::mutex> lock(dispatcher.mutex);
+            stream->submitted++;
+            // Make room by dropping the oldest queued frame
+            if (stream->freeFrames.empty() && stream->queueCount > 0) {
+                stream->freeFrames.push_back(stream->Pop());
+                stream->dropped++;
             }
+            // Every frame buffer is being processed by a worker
+            if (stream->freeFrames.empty()) {
+                stream->dropped++;
+                return 0;
+            }
+            frameIndex = stream->freeFrames.back();
+            stream->freeFrames.pop_back();
         }
 
-        // Add alpha channel
-        cv::cvtColor(texture, texture, cv::COLOR_RGB2RGBA);
-        // Copy values form the OpenCV Mat back to inputData
-        std::memcpy(inputData, texture.data, texture.total() * texture.channels());
+        // Copy the frame outside the lock, the buffer belongs to this thread until it is queued
+        StreamFrame& frame = stream->frames[frameIndex];
+        ImageView src = MakeImageView(inputData, inputDesc, stream->width, stream->height);
+        size_t rowBytes = static_cast<size_t>(stream->width) * src.layout.channels;
+        for (int y = 0; y < stream->height; y++) {
+            std::memcpy(frame.pixels.data() + y * rowBytes, src.data + y * src.pitch, rowBytes);
+        }
+        frame.layout = src.layout;
+        frame.submitTime = std::chrono::steady_clock::now();
+        frame.deadline = frame.submitTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<float, std::milli>(stream->deadlineMs));
+
+        int sequence = 0;
+        {
+            std::lock_guard<std::mutex> lock(dispatcher.mutex);
+            // Another producer may have filled the queue while the frame was copied
+            if (stream->queueCount == stream->queue.size()) {
+                stream->freeFrames.push_back(stream->Pop());
+                stream->dropped++;
+            }
+            sequence = stream->nextSequence++;
+            frame.sequence = sequence;
+            stream->Push(frameIndex);
+        }
+        dispatcher.frameQueued.notify_one();
+        return sequence;
+    }
+
+    // Copy the newest stylized frame of a stream to the output buffer
+    // A null descriptor means a tightly packed top-down RGBA buffer
+    // Returns the sequence number of the copied frame, or zero if no frame has finished yet
+    DLLExport int GetStreamResult(int streamId, uchar* outputData, const BufferDesc* outputDesc) {
+        std::shared_ptr<InferenceStream> stream = FindStream(streamId);
+        if (!stream) return 0;
+
+        std::lock_guard<std::mutex> lock(stream->resultMutex);
+        if (stream->resultSequence == 0) return 0;
+        ImageView dst = MakeImageView(outputData, outputDesc, stream->width, stream->height);
+        ImageView result = { stream->result.data(), static_cast<ptrdiff_t>(stream->width) * 4, pixelLayouts[CHANNEL_ORDER_RGBA] };
+        CopyImage(result, dst, stream->width, stream->height);
+        return stream->resultSequence;
+    }
+
+    // Get the latency and drop statistics of a stream
+    DLLExport void GetStreamStats(int streamId, StreamStats* stats) {
+        *stats = StreamStats();
+        std::shared_ptr<InferenceStream> stream = FindStream(streamId);
+        if (!stream) return;
+
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        stats->submitted = stream->submitted;
+        stats->completed = stream->completed;
+        stats->dropped = stream->dropped;
+        stats->lateFrames = stream->lateFrames;
+        stats->queued = static_cast<int>(stream->queueCount);
+        stats->latencyMs = stream->latencyMs;
+        stats->maxLatencyMs = stream->maxLatencyMs;
+        stats->serviceMs = stream->serviceMs;
     }
-}
\ No newline at end of file
+}
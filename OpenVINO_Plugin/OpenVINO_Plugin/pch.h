@@ -9,8 +9,19 @@
 
 // add headers that you want to pre-compile here
 #include "framework.h"
+#include <psapi.h>
 //#include <memory>
 #include <regex>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <thread>
+#include <emmintrin.h>
 #include <inference_engine.hpp>
 #include <opencv2/opencv.hpp>
 
@@ -45,6 +45,18 @@ public class StyleTransfer : MonoBehaviour
     // Name of the DLL file
     const string dll = "OpenVINO_Plugin";
 
+    // Describes the memory layout of an image buffer passed to the DLL
+    [StructLayout(LayoutKind.Sequential)]
+    private struct BufferDesc
+    {
+        // Bytes between the starts of consecutive rows, 0 for tightly packed rows
+        public int rowPitch;
+        // Nonzero if the rows are stored bottom-up
+        public int flipY;
+        // 0 = RGBA, 1 = BGRA, 2 = RGB
+        public int channelOrder;
+    }
+
     [DllImport(dll)]
     private static extern IntPtr GetAvailableDevices();
 
@@ -63,6 +75,15 @@ public class StyleTransfer : MonoBehaviour
     [DllImport(dll)]
     private static extern void PerformInference(IntPtr inputData);
 
+    [DllImport(dll)]
+    private static extern void PerformInferenceEx(IntPtr inputData, ref BufferDesc inputDesc, IntPtr outputData, ref BufferDesc outputDesc);
+
+    [DllImport(dll)]
+    private static extern void PrepareModel(string modelPath, int deviceNum);
+
+    [DllImport(dll)]
+    private static extern int SwapModel();
+
     // The compiled model used for performing inference
     private Model[] m_RuntimeModels;
 
@@ -95,6 +116,9 @@ public class StyleTransfer : MonoBehaviour
     // Names of the ONNX models
     private List<string> onnxModels = new List<string>();
 
+    // Indicates an OpenVINO model is being prepared in the background
+    private bool modelPending = false;
+
     // Start is called before the first frame update
     void Start()
     {
@@ -346,11 +370,11 @@ public class StyleTransfer : MonoBehaviour
     public void UpdateModel()
     {
         Debug.Log($"Selecte Model: {modelDropdown.value}");
-        // Initialize the selected OpenVINO model
+        // Prepare the selected OpenVINO model in the background
         if (inferenceEngineDropdown.value == 0)
         {
-            InitializeOpenVINO(openVINOPaths[modelDropdown.value]);
-            UpdateInputDims();
+            PrepareModel(openVINOPaths[modelDropdown.value], deviceDropdown.value);
+            modelPending = true;
         }
     }
 
@@ -363,8 +387,10 @@ public class StyleTransfer : MonoBehaviour
         //Pin Memory
         fixed (byte* p = inputData)
         {
+            // Texture data is stored bottom-up, so let the DLL flip the rows while packing and unpacking
+            BufferDesc desc = new BufferDesc { rowPitch = 0, flipY = 1, channelOrder = 0 };
             // Perform inference with OpenVINO
-            PerformInference((IntPtr)p);
+            PerformInferenceEx((IntPtr)p, ref desc, (IntPtr)p, ref desc);
         }
     }
 
@@ -401,8 +427,6 @@ public class StyleTransfer : MonoBehaviour
             {
                 // Copy current frame to smaller temporary texture
                 Graphics.Blit(src, tempTex);
-                // Flip image before sending to DLL
-                ProcessImage(tempTex, "FlipXAxis");
 
                 if (useAsync.isOn)
                 {
@@ -425,8 +449,6 @@ public class StyleTransfer : MonoBehaviour
                 inputTex.Apply();
                 // Copy output image to temporary texture
                 Graphics.Blit(inputTex, tempTex);
-                // Flip output image from DLL
-                ProcessImage(tempTex, "FlipXAxis");
                 // Copy the temporary texture to the source resolution texture
                 Graphics.Blit(tempTex, src);
             }
@@ -483,6 +505,15 @@ public class StyleTransfer : MonoBehaviour
     // Update is called once per frame
     void Update()
     {
-        
+        // Swap in the new OpenVINO model between frames once it is ready
+        if (modelPending)
+        {
+            int status = SwapModel();
+            if (status != 0)
+            {
+                modelPending = false;
+                Debug.Log(status > 0 ? "Swapped OpenVINO model" : "Failed to prepare OpenVINO model");
+            }
+        }
     }
 }